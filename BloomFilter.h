@@ -0,0 +1,135 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Split-block Bloom filter for skipping join probes that cannot match
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+/* A key sets one bit in each of the eight words of a single 64-byte block,
+ * so adding or checking a key touches one cache line. The block comes from
+ * the high half of the key's hash and the bits from the low half, each
+ * word's bit picked by its own odd multiplier. At bitsPerKey bits per key
+ * about 0.5% of absent keys get through. A default-constructed filter holds
+ * nothing and lets every key through.
+ */
+class BloomFilter {
+public:
+    BloomFilter() = default;
+
+    // Sized for keys distinct keys
+    explicit BloomFilter(size_t keys)
+        :blocks((keys * bitsPerKey + blockBits - 1) / blockBits + 1), capacity(keys) {}
+
+    // Spreads a std::hash value over all 64 bits; integer hashes are often the value itself
+    static uint64_t mix(size_t h)
+    {
+        uint64_t x = h;
+        x ^= x >> 33;
+        x *= 0xFF51AFD7ED558CCDull;
+        x ^= x >> 33;
+        x *= 0xC4CEB9FE1A85EC53ull;
+        x ^= x >> 33;
+        return x;
+    }
+
+    void add(uint64_t h)
+    {
+        if (blocks.empty())
+            return;
+        Block& block = blocks[index(h)];
+        uint32_t low = static_cast<uint32_t>(h);
+        for (size_t w = 0; w < 8; ++w)
+            block.words[w] |= bit(low, w);
+    }
+
+    bool mayContain(uint64_t h) const
+    {
+        if (blocks.empty())
+            return true;
+        const Block& block = blocks[index(h)];
+        uint32_t low = static_cast<uint32_t>(h);
+        for (size_t w = 0; w < 8; ++w)
+            if (!(block.words[w] & bit(low, w)))
+                return false;
+        return true;
+    }
+
+    bool empty() const
+    {
+        return blocks.empty();
+    }
+
+    size_t bytes() const
+    {
+        return blocks.size() * sizeof(Block);
+    }
+
+    // Whether keys distinct keys still get the intended false positive rate
+    bool fits(size_t keys) const
+    {
+        return keys <= capacity;
+    }
+
+private:
+    static constexpr size_t bitsPerKey = 16, blockBits = 512;
+
+    struct alignas(64) Block
+    {
+        uint64_t words[8] = {};
+    };
+
+    std::vector<Block> blocks;
+    size_t capacity = 0;
+
+    size_t index(uint64_t h) const
+    {
+        return static_cast<size_t>(((h >> 32) * blocks.size()) >> 32);
+    }
+
+    static uint64_t bit(uint32_t low, size_t w)
+    {
+        static constexpr uint32_t salt[8] = { 0x47B6137Bu, 0x44974D91u, 0x8824AD5Bu, 0xA2B7289Du,
+                                              0x705495C7u, 0x2DF1424Bu, 0x9EFC4947u, 0x5C6BFB31u };
+        return uint64_t(1) << ((low * salt[w]) >> 26);
+    }
+};
+
+/* Checks probe keys against a filter only while that pays off. Each check
+ * costs a hash and a cache line, so once a sample of sampleKeys probes
+ * shows fewer than one in four rejected, the rest go straight to the hash
+ * table.
+ */
+class BloomProbe {
+public:
+    BloomProbe(const BloomFilter& f, bool use)
+        :filter(f), on(use) {}
+
+    bool active() const
+    {
+        return on;
+    }
+
+    // Whether the key with hash h is certainly absent
+    bool reject(uint64_t h)
+    {
+        bool absent = !filter.mayContain(h);
+        if (checked < sampleKeys)
+        {
+            rejected += absent;
+            if (++checked == sampleKeys)
+                on = rejected * 4 >= sampleKeys;
+        }
+        return absent;
+    }
+
+private:
+    static constexpr size_t sampleKeys = 4096;
+
+    const BloomFilter& filter;
+    bool on;
+    size_t checked = 0, rejected = 0;
+};
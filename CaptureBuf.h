@@ -0,0 +1,69 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Input streambuf that can record the text a command reads
+
+#pragma once
+
+#include <algorithm>
+#include <streambuf>
+#include <string>
+
+
+/* Reads through another streambuf (cin's) with its own buffer. Between
+ * start() and take() the characters consumed are copied out, up to limit
+ * of them, which is how the slow command log gets the command text. Refills
+ * only ask the source for what it already has, so interactive input still
+ * works a line at a time.
+ */
+class CaptureBuf : public std::streambuf {
+public:
+    CaptureBuf(std::streambuf* s, size_t lim)
+        :source(s), limit(lim)
+    {
+        setg(buf, buf, buf);
+        mark = buf;
+    }
+
+    void start()
+    {
+        text.clear();
+        mark = gptr();
+        recording = true;
+    }
+
+    std::string take()
+    {
+        save();
+        recording = false;
+        return std::move(text);
+    }
+
+protected:
+    int_type underflow() override
+    {
+        save();
+        if (traits_type::eq_int_type(source->sgetc(), traits_type::eof()))
+            return traits_type::eof();
+        std::streamsize n = std::min<std::streamsize>(std::max<std::streamsize>(source->in_avail(), 1), sizeof(buf));
+        n = source->sgetn(buf, n);
+        setg(buf, buf, buf + n);
+        mark = buf;
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    std::streambuf* source;
+    size_t limit;
+    char buf[1 << 12];
+    char* mark;
+    bool recording = false;
+    std::string text;
+
+    //Copies what was read since mark
+    void save()
+    {
+        if (recording && text.size() < limit)
+            text.append(mark, std::min(static_cast<size_t>(gptr() - mark), limit - text.size()));
+        mark = gptr();
+    }
+};
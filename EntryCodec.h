@@ -0,0 +1,141 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Compact binary encoding of TableEntry for operators that spill to disk
+
+#pragma once
+
+#include "TableEntry.h"
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+
+
+/* EntryCodec is a friend of TableEntry so it can read the value out without
+ * going through the printing operators. The type tag is not written, readers
+ * already know the column types from the table.
+ *
+ * Layout: int/double/bool are written as their raw bytes, strings as a
+ * uint32_t length followed by the characters. pack() has its own layout,
+ * for keys of multi-column indexes.
+ */
+class EntryCodec {
+public:
+    static EntryType type(const TableEntry& tt) noexcept
+    {
+        return tt.tag;
+    }
+
+    static void write(std::ostream& os, const TableEntry& tt)
+    {
+        switch (tt.tag)
+        {
+        case EntryType::String:
+        {
+            uint32_t len = static_cast<uint32_t>(tt.data_string.size());
+            os.write(reinterpret_cast<const char*>(&len), sizeof(len));
+            os.write(tt.data_string.data(), len);
+            break;
+        }
+        case EntryType::Double:
+            os.write(reinterpret_cast<const char*>(&tt.data_double), sizeof(tt.data_double));
+            break;
+        case EntryType::Int:
+            os.write(reinterpret_cast<const char*>(&tt.data_int), sizeof(tt.data_int));
+            break;
+        case EntryType::Bool:
+            os.write(reinterpret_cast<const char*>(&tt.data_bool), sizeof(tt.data_bool));
+            break;
+        }
+    }
+
+    static TableEntry read(std::istream& is, EntryType type)
+    {
+        switch (type)
+        {
+        case EntryType::String:
+        {
+            uint32_t len = 0;
+            is.read(reinterpret_cast<char*>(&len), sizeof(len));
+            std::string val(len, '\0');
+            is.read(&val[0], len);
+            return TableEntry(std::move(val));
+        }
+        case EntryType::Double:
+        {
+            double val = 0;
+            is.read(reinterpret_cast<char*>(&val), sizeof(val));
+            return TableEntry(val);
+        }
+        case EntryType::Int:
+        {
+            int val = 0;
+            is.read(reinterpret_cast<char*>(&val), sizeof(val));
+            return TableEntry(val);
+        }
+        case EntryType::Bool:
+        {
+            bool val = false;
+            is.read(reinterpret_cast<char*>(&val), sizeof(val));
+            return TableEntry(val);
+        }
+        }
+        std::terminate();
+    }
+
+    // Appends tt to a composite key. Keys packed from the same column types
+    // compare as strings (bytewise) the way the values compare column by
+    // column, and are equal exactly when every value is: numbers go in
+    // big-endian with the sign flipped, strings escape their zero bytes and
+    // end in 0x00 0x01 so a prefix sorts first.
+    static void pack(std::string& key, const TableEntry& tt)
+    {
+        switch (tt.tag)
+        {
+        case EntryType::String:
+            for (char c : tt.data_string)
+            {
+                key += c;
+                if (c == '\0')
+                    key += '\xFF';
+            }
+            key += '\0';
+            key += '\1';
+            break;
+        case EntryType::Double:
+        {
+            //-0.0 == 0.0, so both get the same bytes
+            double val = tt.data_double == 0 ? 0.0 : tt.data_double;
+            uint64_t bits;
+            std::memcpy(&bits, &val, sizeof(bits));
+            bits = bits >> 63 ? ~bits : bits | (uint64_t(1) << 63);
+            packBigEndian(key, bits, sizeof(bits));
+            break;
+        }
+        case EntryType::Int:
+            packBigEndian(key, static_cast<uint32_t>(tt.data_int) ^ 0x80000000u, sizeof(uint32_t));
+            break;
+        case EntryType::Bool:
+            key += tt.data_bool ? '\1' : '\0';
+            break;
+        }
+    }
+
+    // Bytes held in memory by the entry, counting a string's heap buffer
+    static size_t bytes(const TableEntry& tt) noexcept
+    {
+        size_t size = sizeof(TableEntry);
+        if (tt.tag == EntryType::String && tt.data_string.capacity() > std::string().capacity())
+            size += tt.data_string.capacity() + 1;
+        return size;
+    }
+
+private:
+    static void packBigEndian(std::string& key, uint64_t bits, size_t bytes)
+    {
+        for (size_t i = bytes; i > 0; --i)
+            key += static_cast<char>((bits >> (8 * (i - 1))) & 0xFF);
+    }
+};
@@ -0,0 +1,235 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Spill-capable sort used when an operator's input does not fit in memory
+
+#pragma once
+
+#include "Parallel.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+
+
+// Smallest sort run or join partition worth a temp file of its own
+constexpr size_t minSpillBytes = size_t(1) << 20;
+
+// Creates an empty file in dir and returns its name, or "" if that failed
+inline std::string makeTempFile(const std::string& dir, const std::string& prefix)
+{
+    std::string name = dir + "/" + prefix + "-XXXXXX";
+    int fd = mkstemp(&name[0]);
+    if (fd == -1)
+        return "";
+    close(fd);
+    return name;
+}
+
+/* Collects records in memory until their estimated size passes the budget,
+ * then sorts the buffer and writes it out as a run in the temp directory.
+ * drain() hands back every record in order, straight from memory when
+ * nothing was spilled and otherwise through a k-way merge of the runs.
+ * Once a run can't be written (no temp file, or a full disk) nothing more
+ * is spilled: the records stay in memory and join the merge as one more run.
+ * Runs hold at least minSpillBytes whatever the budget, so a tiny budget
+ * doesn't write one file per record.
+ *
+ * Codec provides
+ *   size_t bytes(const Record&)           in-memory size estimate
+ *   void write(std::ostream&, const Record&)
+ *   bool read(std::istream&, Record&)     false at the end of a run
+ * and Less is a strict weak ordering on Record.
+ */
+template <typename Record, typename Codec, typename Less>
+class ExternalSorter {
+public:
+    ExternalSorter(Codec c, Less l, size_t budgetBytes, std::string tmpDir)
+        :codec(std::move(c)), less(std::move(l)), budget(std::max(budgetBytes, minSpillBytes)), dir(std::move(tmpDir)) {}
+    ExternalSorter(const ExternalSorter&) = delete;
+    ExternalSorter& operator=(const ExternalSorter&) = delete;
+
+    ~ExternalSorter()
+    {
+        for (const Run& run : files)
+            std::remove(run.name.c_str());
+    }
+
+    void push(Record&& rec)
+    {
+        used += codec.bytes(rec);
+        buffer.push_back(std::move(rec));
+        if (used > budget)
+            spill();
+    }
+
+    size_t runs() const
+    {
+        return files.size();
+    }
+
+    // Calls emit(const Record&) in sorted order until it returns false.
+    // Returns false if a spilled run could not be read back whole, in which
+    // case records are missing from what was emitted.
+    template <typename F>
+    bool drain(F emit)
+    {
+        if (files.empty() || (!buffer.empty() && !spill()))
+            parallelSort(buffer.begin(), buffer.end(), less);
+        if (files.empty())
+        {
+            for (const Record& rec : buffer)
+                if (!emit(rec))
+                    break;
+            buffer.clear();
+            return true;
+        }
+        //Merges in rounds so no more than maxFanIn runs are open at once;
+        //if a round can't be written the rest are merged at a wider fan-in
+        while (files.size() > maxFanIn)
+        {
+            Run out{ tempFile(), 0 };
+            if (out.name.empty())
+                break;
+            std::ofstream os(out.name, std::ios::binary);
+            std::vector<Run> group(files.begin(), files.begin() + maxFanIn);
+            bool whole = merge(group, std::vector<Record>(), [&](const Record& rec) {
+                codec.write(os, rec);
+                ++out.records;
+                return true;
+            });
+            os.flush();
+            if (!whole)
+            {
+                std::remove(out.name.c_str());
+                return false;
+            }
+            if (!os)
+            {
+                std::remove(out.name.c_str());
+                break;
+            }
+            for (const Run& run : group)
+                std::remove(run.name.c_str());
+            files.erase(files.begin(), files.begin() + maxFanIn);
+            files.push_back(out);
+        }
+        bool whole = merge(files, buffer, emit);
+        buffer.clear();
+        return whole;
+    }
+
+private:
+    static constexpr size_t maxFanIn = 64;
+
+    //A sorted run on disk and how many records went into it
+    struct Run
+    {
+        std::string name;
+        size_t records;
+    };
+
+    Codec codec;
+    Less less;
+    size_t budget, used = 0;
+    std::string dir;
+    std::vector<Record> buffer;
+    std::vector<Run> files;
+
+    std::string tempFile()
+    {
+        return makeTempFile(dir, "silly-sort");
+    }
+
+    // Writes the buffer out as a run. Returns false, leaving the buffer in
+    // memory and turning spilling off, if the run could not be written.
+    bool spill()
+    {
+        if (budget == static_cast<size_t>(-1))
+            return false;
+        TraceSpan span("spill run", "io");
+        Run run{ tempFile(), buffer.size() };
+        if (!run.name.empty())
+        {
+            parallelSort(buffer.begin(), buffer.end(), less);
+            std::ofstream os(run.name, std::ios::binary);
+            for (const Record& rec : buffer)
+                codec.write(os, rec);
+            os.flush();
+            if (os)
+            {
+                files.push_back(run);
+                buffer.clear();
+                used = 0;
+                return true;
+            }
+            std::remove(run.name.c_str());
+        }
+        //Nowhere to spill to, keep sorting in memory
+        budget = static_cast<size_t>(-1);
+        return false;
+    }
+
+    // Merges the runs and the sorted records in memory. Returns false if a
+    // run ended before all its records were read back.
+    template <typename F>
+    bool merge(const std::vector<Run>& runs, const std::vector<Record>& memory, F emit)
+    {
+        std::vector<std::unique_ptr<std::ifstream>> ins;
+        std::vector<size_t> left;
+        //Each source's current record; memory is source runs.size() and is
+        //read in place
+        std::vector<Record> heads(runs.size());
+        std::vector<const Record*> current(runs.size() + 1);
+        size_t next = 0;
+        bool whole = true;
+        auto advance = [&](size_t i) {
+            if (i == runs.size())
+            {
+                if (next == memory.size())
+                    return false;
+                current[i] = &memory[next++];
+                return true;
+            }
+            if (left[i] == 0)
+                return false;
+            if (!codec.read(*ins[i], heads[i]))
+            {
+                whole = false;
+                return false;
+            }
+            current[i] = &heads[i];
+            --left[i];
+            return true;
+        };
+        //Min-heap of source numbers by their current record
+        auto after = [&](size_t a, size_t b) { return less(*current[b], *current[a]); };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(after)> heap(after);
+        for (size_t i = 0; i <= runs.size(); ++i)
+        {
+            if (i < runs.size())
+            {
+                ins.emplace_back(new std::ifstream(runs[i].name, std::ios::binary));
+                left.push_back(runs[i].records);
+            }
+            if (advance(i))
+                heap.push(i);
+        }
+        while (!heap.empty())
+        {
+            size_t i = heap.top();
+            heap.pop();
+            if (!emit(*current[i]))
+                return whole;
+            if (advance(i))
+                heap.push(i);
+        }
+        return whole;
+    }
+};
@@ -0,0 +1,80 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Buffered streambuf over a socket, for server sessions
+
+#pragma once
+
+#include <cerrno>
+#include <streambuf>
+#include <unistd.h>
+
+
+/* Reads and writes a file descriptor through one buffer each way. The
+ * descriptor stays open; whoever accepted it closes it. A failed write
+ * drops the rest of the output, which is what a client hanging up mid
+ * result should do.
+ */
+class FdBuf : public std::streambuf {
+public:
+    explicit FdBuf(int f)
+        :fd(f)
+    {
+        setg(inBuf, inBuf, inBuf);
+        setp(outBuf, outBuf + sizeof(outBuf));
+    }
+    FdBuf(const FdBuf&) = delete;
+    FdBuf& operator=(const FdBuf&) = delete;
+    ~FdBuf()
+    {
+        sync();
+    }
+
+protected:
+    int_type underflow() override
+    {
+        ssize_t n;
+        do
+            n = ::read(fd, inBuf, sizeof(inBuf));
+        while (n == -1 && errno == EINTR);
+        if (n <= 0)
+            return traits_type::eof();
+        setg(inBuf, inBuf, inBuf + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    int_type overflow(int_type c) override
+    {
+        if (sync() == -1)
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override
+    {
+        const char* p = pbase();
+        while (p < pptr())
+        {
+            ssize_t n = ::write(fd, p, static_cast<size_t>(pptr() - p));
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                setp(outBuf, outBuf + sizeof(outBuf));
+                return -1;
+            }
+            p += n;
+        }
+        setp(outBuf, outBuf + sizeof(outBuf));
+        return 0;
+    }
+
+private:
+    int fd;
+    char inBuf[1 << 12];
+    char outBuf[1 << 14];
+};
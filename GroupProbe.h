@@ -0,0 +1,101 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Hash table lookups issued in groups so their cache misses overlap
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+
+
+/* A lookup in a big std::unordered_map is a chain of dependent cache
+ * misses: the bucket slot, then the node. One find() at a time keeps only
+ * one of those chains in flight. GroupProbe queues keys with their hash
+ * and, once Group of them are waiting, runs them in passes: every bucket
+ * slot is read and its first node prefetched, then each bucket is walked
+ * against warm lines, then the matched values are prefetched before the
+ * callbacks see them. Callbacks get the keys in the order they were pushed,
+ * with a pointer to the key's value or nullptr if it has none.
+ *
+ * The hash must be the map's own hash of the key, so a caller that already
+ * hashed the key (for a Bloom filter, say) doesn't hash it again. Its
+ * bucket is hash % bucket_count(), as both libstdc++ and libc++ place keys.
+ *
+ * Keys are held by pointer and must stay put until the group is flushed.
+ */
+template <typename Map, size_t Group = 16>
+class GroupProbe {
+public:
+    using Value = typename Map::mapped_type;
+
+    explicit GroupProbe(const Map& m)
+        :map(m) {}
+
+    // Queues key under tag; calls f(tag, const Value*) for each queued key once the group is full
+    template <typename F>
+    void push(const typename Map::key_type& key, size_t tag, F f)
+    {
+        push(key, map.hash_function()(key), tag, f);
+    }
+
+    template <typename F>
+    void push(const typename Map::key_type& key, size_t hash, size_t tag, F f)
+    {
+        keys[waiting] = &key;
+        hashes[waiting] = hash;
+        tags[waiting] = tag;
+        if (++waiting == Group)
+            flush(f);
+    }
+
+    // Runs whatever is still queued
+    template <typename F>
+    void flush(F f)
+    {
+        for (size_t j = 0; j < waiting; ++j)
+            found[j] = nullptr;
+        //An empty map may have no buckets at all
+        if (!map.empty())
+        {
+            size_t buckets[Group], count = map.bucket_count();
+            for (size_t j = 0; j < waiting; ++j)
+            {
+                buckets[j] = hashes[j] % count;
+                assert(buckets[j] == map.bucket(*keys[j]));
+            }
+            for (size_t j = 0; j < waiting; ++j)
+            {
+                auto node = map.begin(buckets[j]);
+                if (node != map.end(buckets[j]))
+                    __builtin_prefetch(&*node);
+            }
+            for (size_t j = 0; j < waiting; ++j)
+                for (auto node = map.begin(buckets[j]); node != map.end(buckets[j]); ++node)
+                    if (node->first == *keys[j])
+                    {
+                        found[j] = &node->second;
+                        prefetchValue(node->second);
+                        break;
+                    }
+        }
+        for (size_t j = 0; j < waiting; ++j)
+            f(tags[j], found[j]);
+        waiting = 0;
+    }
+
+private:
+    const Map& map;
+    const typename Map::key_type* keys[Group];
+    size_t hashes[Group];
+    size_t tags[Group];
+    const Value* found[Group];
+    size_t waiting = 0;
+
+    // Posting lists live apart from their node
+    template <typename V>
+    static void prefetchValue(const V& value)
+    {
+        if (!value.empty())
+            __builtin_prefetch(value.data());
+    }
+};
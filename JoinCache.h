@@ -0,0 +1,104 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// LRU cache of join hash tables, shared by every session
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+
+/* Holds the hash tables joins build over unindexed columns, keyed by table
+ * and column. Each remembers the table version and row count it was built
+ * from; a lookup for any other snapshot misses and drops it, so a table
+ * changed by INSERT, DELETE or reclaiming dead rows is rebuilt on its next
+ * join. Maps are handed out as shared_ptrs, so evicting one never pulls it
+ * from under a join still probing it. Least recently used maps go first once
+ * the total passes the budget; 0 turns caching off.
+ */
+template <typename Map>
+class JoinCache {
+public:
+    using Ptr = std::shared_ptr<const Map>;
+
+    void setBudget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        budget = bytes;
+        evict();
+    }
+
+    // The map for (table, col) built at version over count rows, if cached
+    Ptr find(const std::string& table, const std::string& col, uint64_t version, size_t count)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries.find({ table, col });
+        if (it == entries.end())
+            return nullptr;
+        if (it->second->version != version || it->second->count != count)
+        {
+            drop(it);
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->map;
+    }
+
+    // Caches map unless it alone is over the budget
+    void insert(const std::string& table, const std::string& col, uint64_t version, size_t count, Ptr map, size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (bytes > budget)
+            return;
+        auto it = entries.find({ table, col });
+        if (it != entries.end())
+            drop(it);
+        lru.push_front({ table, col, version, count, bytes, std::move(map) });
+        entries[{ table, col }] = lru.begin();
+        used += bytes;
+        evict();
+    }
+
+    // Forgets every map of table, for when it is removed
+    void erase(const std::string& table)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries.lower_bound({ table, std::string() });
+        while (it != entries.end() && it->first.first == table)
+            drop(it++);
+    }
+
+private:
+    struct Entry
+    {
+        std::string table, col;
+        uint64_t version;
+        size_t count, bytes;
+        Ptr map;
+    };
+
+    std::mutex mtx;
+    //Most recently used first
+    std::list<Entry> lru;
+    std::map<std::pair<std::string, std::string>, typename std::list<Entry>::iterator> entries;
+    size_t budget = size_t(256) << 20, used = 0;
+
+    void drop(typename decltype(entries)::iterator it)
+    {
+        used -= it->second->bytes;
+        lru.erase(it->second);
+        entries.erase(it);
+    }
+
+    void evict()
+    {
+        while (used > budget)
+            drop(entries.find({ lru.back().table, lru.back().col }));
+    }
+};
@@ -0,0 +1,82 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Log-linear latency histogram for per-command timing
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+/* HDR-style histogram of nanosecond values. Values below 128 get a bucket
+ * each; above that every power of two is split into 64 buckets, so a
+ * reported percentile is within about 1.5% of the true value. Recording is
+ * a couple of shifts and an increment.
+ */
+class LatencyHistogram {
+public:
+    void record(uint64_t ns)
+    {
+        ++counts[index(ns)];
+        ++total;
+        largest = std::max(largest, ns);
+    }
+
+    uint64_t count() const
+    {
+        return total;
+    }
+
+    uint64_t max() const
+    {
+        return largest;
+    }
+
+    // Smallest recorded bucket value with at least p (0..1) of values at or below it
+    uint64_t percentile(double p) const
+    {
+        if (total == 0)
+            return 0;
+        uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(p * static_cast<double>(total) + 0.999999));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            seen += counts[i];
+            if (seen >= target)
+                return std::min(upper(i), largest);
+        }
+        return largest;
+    }
+
+    void merge(const LatencyHistogram& other)
+    {
+        for (size_t i = 0; i < counts.size(); ++i)
+            counts[i] += other.counts[i];
+        total += other.total;
+        largest = std::max(largest, other.largest);
+    }
+
+private:
+    static constexpr unsigned subBits = 7, half = 1u << (subBits - 1);
+
+    std::vector<uint64_t> counts = std::vector<uint64_t>((64 - subBits + 2) * half, 0);
+    uint64_t total = 0, largest = 0;
+
+    static size_t index(uint64_t v)
+    {
+        if (v < (uint64_t(1) << subBits))
+            return static_cast<size_t>(v);
+        unsigned shift = static_cast<unsigned>(63 - __builtin_clzll(v)) - (subBits - 1);
+        return shift * half + static_cast<size_t>(v >> shift);
+    }
+
+    // Largest value that falls in bucket i
+    static uint64_t upper(size_t i)
+    {
+        if (i < (size_t(1) << subBits))
+            return i;
+        uint64_t shift = i / half - 1, mantissa = i % half + half;
+        return ((mantissa + 1) << shift) - 1;
+    }
+};
@@ -0,0 +1,222 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Small threading helpers shared by the SillyQL operators
+
+#pragma once
+
+#include "Trace.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Number of worker threads to use, never less than one.
+inline size_t workerCount()
+{
+    size_t n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+// Calls f(begin, end) for consecutive slices of [0, n), one slice per
+// thread, none shorter than minChunk. Small n (or a single core) runs on
+// the calling thread.
+template <typename F>
+void parallelFor(size_t n, F f, size_t minChunk = 1 << 15)
+{
+    size_t chunks = std::min(workerCount(), n / minChunk);
+    if (chunks < 2)
+    {
+        f(size_t(0), n);
+        return;
+    }
+    std::vector<std::thread> threads;
+    threads.reserve(chunks);
+    for (size_t i = 0; i < chunks; ++i)
+        threads.emplace_back([&f, i, n, chunks]() {
+            TraceSpan span("slice", "worker");
+            f(i * n / chunks, (i + 1) * n / chunks);
+        });
+    for (auto& t : threads)
+        t.join();
+}
+
+/* Sorts [first, last) with comp by sorting equal chunks on separate threads
+ * and then merging neighbouring chunks pairwise. Small inputs (or a single
+ * core) just use std::sort. comp must be a strict weak ordering; ties are
+ * not kept stable, so give it a tie-breaker if the order of equal elements
+ * matters.
+ */
+template <typename It, typename Comp>
+void parallelSort(It first, It last, Comp comp, size_t minChunk = 1 << 15)
+{
+    size_t n = static_cast<size_t>(std::distance(first, last));
+    size_t chunks = std::min(workerCount(), n / minChunk);
+    if (chunks < 2)
+    {
+        std::sort(first, last, comp);
+        return;
+    }
+
+    std::vector<It> bounds;
+    bounds.reserve(chunks + 1);
+    for (size_t i = 0; i < chunks; ++i)
+        bounds.push_back(std::next(first, static_cast<std::ptrdiff_t>(i * n / chunks)));
+    bounds.push_back(last);
+
+    std::vector<std::thread> threads;
+    threads.reserve(chunks);
+    for (size_t i = 0; i < chunks; ++i)
+        threads.emplace_back([&bounds, &comp, i]() {
+            TraceSpan span("sort chunk", "worker");
+            std::sort(bounds[i], bounds[i + 1], comp);
+        });
+    for (auto& t : threads)
+        t.join();
+
+    //Merges neighbouring runs until one is left
+    for (size_t width = 1; width < chunks; width *= 2)
+    {
+        threads.clear();
+        for (size_t i = 0; i + width < chunks; i += 2 * width)
+        {
+            It lo = bounds[i], mid = bounds[i + width];
+            It hi = bounds[std::min(i + 2 * width, chunks)];
+            threads.emplace_back([lo, mid, hi, &comp]() {
+                TraceSpan span("merge", "worker");
+                std::inplace_merge(lo, mid, hi, comp);
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+    }
+}
+
+/* Runs submitted tasks on a fixed set of threads, each with its own deque.
+ * A worker runs its newest task first and, once its deque is empty, steals
+ * the oldest task of another worker. Tasks submitted from a worker go on
+ * that worker's deque, so a task that readies the next one in a chain
+ * usually runs it itself while the cache is still warm. The destructor
+ * waits for every submitted task to finish.
+ */
+class TaskPool {
+public:
+    explicit TaskPool(size_t threads = workerCount())
+    {
+        for (size_t i = 0; i < threads; ++i)
+            queues.emplace_back(new Queue);
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back([this, i]() { work(i); });
+    }
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+    ~TaskPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers)
+            t.join();
+    }
+
+    void submit(std::function<void()> task)
+    {
+        Worker& self = current();
+        size_t i = self.pool == this ? self.index : next++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(queues[i]->mtx);
+            queues[i]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            ++queued;
+        }
+        wake.notify_one();
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mtx;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    //Which pool and deque the calling thread works for, if any
+    struct Worker
+    {
+        TaskPool* pool = nullptr;
+        size_t index = 0;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable wake;
+    //Tasks sitting in a deque; workers sleep while it is 0
+    size_t queued = 0;
+    size_t next = 0;
+    bool stopping = false;
+
+    static Worker& current()
+    {
+        thread_local Worker self;
+        return self;
+    }
+
+    //Own deque from the back, then the others from the front
+    bool take(size_t i, std::function<void()>& task)
+    {
+        for (size_t k = 0; k < queues.size(); ++k)
+        {
+            Queue& q = *queues[(i + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mtx);
+            if (q.tasks.empty())
+                continue;
+            if (k == 0)
+            {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void work(size_t i)
+    {
+        current().pool = this;
+        current().index = i;
+        std::function<void()> task;
+        while (true)
+        {
+            if (take(i, task))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    --queued;
+                }
+                task();
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mtx);
+            wake.wait(lock, [this]() { return queued > 0 || stopping; });
+            if (queued == 0 && stopping)
+                return;
+        }
+    }
+};
@@ -0,0 +1,264 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Input streambuf fed by a thread that reads commands ahead, for --pipeline
+
+#pragma once
+
+#include "Trace.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+
+/* A reader thread pulls the input ahead of the command being run, cuts it
+ * into blocks at command boundaries (an INSERT's rows stay with it unless
+ * they pass blockBytes) and queues up to maxBlocks of them. Reads through
+ * this buffer see exactly the characters of the source in order, so parsing
+ * and the getline()s that skip bad input behave as before; only reading and
+ * finding the command boundaries move off the executing thread.
+ *
+ * The reader stops after a command starting with Q, since the session ends
+ * there. Anything read past what it queued comes from the source directly.
+ */
+class ReadAhead : public std::streambuf {
+public:
+    explicit ReadAhead(std::streambuf* source, size_t maxBlocks = 16)
+        :state(std::make_shared<State>())
+    {
+        state->source = source;
+        state->maxBlocks = maxBlocks;
+        setg(nullptr, nullptr, nullptr);
+        reader = std::thread(run, state);
+    }
+    ReadAhead(const ReadAhead&) = delete;
+    ReadAhead& operator=(const ReadAhead&) = delete;
+    ~ReadAhead()
+    {
+        bool finished;
+        {
+            std::lock_guard<std::mutex> lock(state->mtx);
+            state->stopped = true;
+            finished = state->finished;
+        }
+        state->changed.notify_all();
+        //A reader still waiting on input after the session ended is left to
+        //finish on its own; it only touches the shared state and the source
+        if (finished)
+            reader.join();
+        else
+            reader.detach();
+    }
+
+    // The first token of line and, for an INSERT, how many row lines follow
+    static void command(const std::string& line, std::string& first, size_t& rows)
+    {
+        const char* space = " \t\r\n\v\f";
+        size_t begin = line.find_first_not_of(space), end;
+        first.clear();
+        rows = 0;
+        for (size_t n = 0; begin != std::string::npos && n < 4; ++n)
+        {
+            end = line.find_first_of(space, begin);
+            std::string token = line.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+            if (n == 0)
+                first = token;
+            else if (n == 3 && first[0] == 'I')
+                rows = static_cast<size_t>(std::strtoull(token.c_str(), nullptr, 10));
+            begin = end == std::string::npos ? end : line.find_first_not_of(space, end);
+        }
+    }
+
+protected:
+    int_type underflow() override
+    {
+        bool direct;
+        {
+            std::unique_lock<std::mutex> lock(state->mtx);
+            state->changed.wait(lock, [this]() { return !state->blocks.empty() || state->finished; });
+            direct = state->blocks.empty();
+            if (!direct)
+            {
+                current = std::move(state->blocks.front());
+                state->blocks.pop_front();
+            }
+        }
+        state->changed.notify_all();
+        if (direct)
+        {
+            std::streambuf* source = state->source;
+            if (traits_type::eq_int_type(source->sgetc(), traits_type::eof()))
+                return traits_type::eof();
+            current.resize(std::min<size_t>(static_cast<size_t>(std::max<std::streamsize>(source->in_avail(), 1)), 1 << 12));
+            current.resize(static_cast<size_t>(source->sgetn(&current[0], static_cast<std::streamsize>(current.size()))));
+        }
+        setg(&current[0], &current[0], &current[0] + current.size());
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    //Blocks are handed over once a command ends and no more input is ready,
+    //or once they pass batchBytes; an INSERT's rows go out every blockBytes
+    static constexpr size_t batchBytes = size_t(64) << 10, blockBytes = size_t(1) << 20;
+
+    struct State
+    {
+        std::streambuf* source;
+        size_t maxBlocks;
+        std::mutex mtx;
+        std::condition_variable changed;
+        std::deque<std::string> blocks;
+        //finished: the reader is done with the source; stopped: nobody
+        //is reading the blocks any more
+        bool finished = false, stopped = false;
+    };
+
+    //Lines of the source, each with its newline
+    class Lines {
+    public:
+        explicit Lines(std::streambuf* s)
+            :source(s) {}
+
+        bool next(std::string& line)
+        {
+            size_t nl;
+            while ((nl = pending.find('\n', pos)) == std::string::npos)
+            {
+                if (!refill())
+                {
+                    line = pending.substr(pos);
+                    pos = pending.size();
+                    return !line.empty();
+                }
+            }
+            line.assign(pending, pos, nl + 1 - pos);
+            pos = nl + 1;
+            return true;
+        }
+
+        // Appends up to n lines to block, stopping early once it holds limit
+        // bytes or the input ends. Returns how many lines went.
+        size_t copy(std::string& block, size_t n, size_t limit)
+        {
+            size_t copied = 0;
+            while (copied < n && block.size() < limit)
+            {
+                size_t end = pos, nl;
+                while (copied < n && block.size() + (end - pos) < limit && (nl = pending.find('\n', end)) != std::string::npos)
+                {
+                    end = nl + 1;
+                    ++copied;
+                }
+                block.append(pending, pos, end - pos);
+                pos = end;
+                if (copied < n && block.size() < limit && !refill())
+                {
+                    if (pos < pending.size())
+                    {
+                        block.append(pending, pos, std::string::npos);
+                        pos = pending.size();
+                        ++copied;
+                    }
+                    break;
+                }
+            }
+            return copied;
+        }
+
+        // Whether the next line can be had without waiting for input
+        bool ready() const
+        {
+            return pending.find('\n', pos) != std::string::npos || source->in_avail() > 0;
+        }
+
+        std::string rest()
+        {
+            std::string text = pending.substr(pos);
+            pos = pending.size();
+            return text;
+        }
+
+    private:
+        std::streambuf* source;
+        std::string pending;
+        size_t pos = 0;
+
+        bool refill()
+        {
+            if (traits_type::eq_int_type(source->sgetc(), traits_type::eof()))
+                return false;
+            pending.erase(0, pos);
+            pos = 0;
+            size_t have = pending.size();
+            size_t n = std::min<size_t>(static_cast<size_t>(std::max<std::streamsize>(source->in_avail(), 1)), size_t(1) << 16);
+            pending.resize(have + n);
+            pending.resize(have + static_cast<size_t>(source->sgetn(&pending[have], static_cast<std::streamsize>(n))));
+            return true;
+        }
+    };
+
+    std::shared_ptr<State> state;
+    std::thread reader;
+    std::string current;
+
+    static bool push(State& s, std::string& block)
+    {
+        if (block.empty())
+            return true;
+        {
+            std::unique_lock<std::mutex> lock(s.mtx);
+            s.changed.wait(lock, [&s]() { return s.blocks.size() < s.maxBlocks || s.stopped; });
+            if (s.stopped)
+                return false;
+            s.blocks.push_back(std::move(block));
+        }
+        s.changed.notify_all();
+        block.clear();
+        return true;
+    }
+
+    static void run(std::shared_ptr<State> s)
+    {
+        Lines lines(s->source);
+        std::string block, line, first;
+        size_t rows;
+        bool open = true, quit = false;
+        while (open && !quit)
+        {
+            TraceSpan span("read ahead", "parse");
+            while (open && !quit && lines.next(line))
+            {
+                block += line;
+                command(line, first, rows);
+                quit = !first.empty() && first[0] == 'Q';
+                while (open && rows > 0)
+                {
+                    rows -= lines.copy(block, rows, blockBytes);
+                    if (block.size() < blockBytes)
+                        break;
+                    open = push(*s, block);
+                }
+                if (block.size() >= batchBytes || !lines.ready())
+                    break;
+            }
+            if (block.empty() && !quit)
+                break;
+            open = open && push(*s, block);
+        }
+        //Whatever was read past the QUIT still belongs to the input
+        block = lines.rest();
+        if (open)
+            push(*s, block);
+        {
+            std::lock_guard<std::mutex> lock(s->mtx);
+            s->finished = true;
+        }
+        s->changed.notify_all();
+    }
+};
@@ -1,31 +1,363 @@
 #include "TableEntry.h"
+#include "EntryCodec.h"
+#include "ExternalSort.h"
+#include "Parallel.h"
+#include "Statistics.h"
+#include "Latency.h"
+#include "CaptureBuf.h"
+#include "Trace.h"
+#include "FdStream.h"
+#include "VersionedRows.h"
+#include "ReadAhead.h"
+#include "JoinCache.h"
+#include "BloomFilter.h"
+#include "GroupProbe.h"
 #include <unordered_map>
 #include <map>
 #include <iostream>
+#include <sstream>
+#include <fstream>
 #include <algorithm>
 #include <vector>
+#include <queue>
+#include <limits>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <iomanip>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <deque>
+#include <array>
+#include <optional>
+#include <functional>
+#include <condition_variable>
+#include <future>
+#include <csignal>
+#include <cstring>
 #include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace std;
 
 class SillyQL {
 
 
+    //Prefix row counts over the bst keys, so a range count is a binary search.
+    //Rebuilt on the first count after the bst changes.
+    class RankIndex {
+    public:
+        void invalidate()
+        {
+            stale = true;
+        }
+        //Readers share the table lock, so the first to find it stale rebuilds
+        void refresh(const map<TableEntry, vector<size_t>>& bst)
+        {
+            lock_guard<mutex> guard(refreshing);
+            if (!stale)
+                return;
+            keys.clear();
+            keys.reserve(bst.size());
+            prefix.assign(1, 0);
+            prefix.reserve(bst.size() + 1);
+            for (auto it = bst.begin(); it != bst.end(); ++it)
+            {
+                keys.push_back(&it->first);
+                prefix.push_back(prefix.back() + it->second.size());
+            }
+            stale = false;
+        }
+        //Rows with key < x
+        size_t below(const TableEntry& x) const
+        {
+            auto it = lower_bound(keys.begin(), keys.end(), &x, [](const TableEntry* a, const TableEntry* b) { return *a < *b; });
+            return prefix[static_cast<size_t>(it - keys.begin())];
+        }
+        //Rows with key <= x
+        size_t atMost(const TableEntry& x) const
+        {
+            auto it = upper_bound(keys.begin(), keys.end(), &x, [](const TableEntry* a, const TableEntry* b) { return *a < *b; });
+            return prefix[static_cast<size_t>(it - keys.begin())];
+        }
+        size_t total() const
+        {
+            return prefix.back();
+        }
+
+    private:
+        vector<const TableEntry*> keys;
+        vector<size_t> prefix = vector<size_t>(1, 0);
+        bool stale = true;
+        mutex refreshing;
+    };
+
+    using Rows = VersionedRows<vector<TableEntry>>;
+
+    //An index GENERATE builds on its own thread over the rows committed when
+    //it ran. Rows inserted meanwhile are appended once it is installed, and
+    //rows deleted meanwhile stay in it as dead rows until they are reclaimed.
+    struct IndexBuild
+    {
+        string type, col;
+        //buckets: the old hash index's, which the new one starts from as a
+        //rebuild in place would
+        size_t rows = 0, buckets = 0;
+        unordered_map<TableEntry, vector<size_t>> hash;
+        BloomFilter bloom;
+        map<TableEntry, vector<size_t>> bst;
+        //Rows in the index so far, for STATUS
+        atomic<size_t> progress{ 0 };
+        promise<void> finished;
+        shared_future<void> done = finished.get_future().share();
+        thread worker;
+
+        ~IndexBuild()
+        {
+            if (worker.joinable())
+                worker.join();
+        }
+
+        bool ready() const
+        {
+            return done.wait_for(chrono::seconds(0)) == future_status::ready;
+        }
+    };
+
+    //Readers and writers don't wait on each other. A reader pins the rows
+    //committed when it starts; INSERT appends rows and DELETE marks them dead
+    //under the next version. The index and stats only change while no reader
+    //is using them, and dead rows are reclaimed once nobody has the table pinned.
     struct Table
     {
-        vector<vector<TableEntry>> entries;
+        Rows entries;
         vector<EntryType> types;
         unordered_map<string, size_t> cols;
         unordered_map<TableEntry, vector<size_t>> hash;
+        //Keys of hash, with room to grow, so join probes can skip it
+        BloomFilter bloom;
         map<TableEntry, vector<size_t>> bst;
+        RankIndex rank;
+        //One per column, empty until the table is analyzed
+        vector<ColumnStats> stats;
         string index = "", name;
+        atomic<uint64_t> committed{ 0 };
+        //Rows deleted but not yet reclaimed
+        atomic<size_t> dead{ 0 };
+        //Rows with postings in the index and rows counted in the stats, and
+        //deletes the stats have yet to hear about
+        size_t indexed = 0, counted = 0, uncounted = 0;
+        //An ANALYZE waiting for readers to let go of the stats
+        vector<ColumnStats> pendingStats;
+        size_t pendingCounted = 0;
+        //Held by INSERT, DELETE, GENERATE and ANALYZE, one at a time
+        mutex writer;
+        //Shared by readers while pinned, reclaiming dead rows needs it alone
+        shared_mutex lock;
+        //Guards the index and stats. Readers share it if they can get it and
+        //scan otherwise, writers only ever try for it.
+        shared_mutex indexLock;
+        //Taken inside the writer lock to swap building, and alone by STATUS
+        //to read it while a writer is busy
+        mutex buildLock;
+        //A GENERATE still building or waiting to be installed, under the
+        //writer lock. Last, so its thread is joined before the rows go.
+        unique_ptr<IndexBuild> building;
+        //Builds a later GENERATE replaced, still reading the rows until they
+        //finish, under the writer lock
+        vector<unique_ptr<IndexBuild>> abandoned;
     };
-    bool quiet = false;
 
-    unordered_map<string, Table> tables;
+    //A row's key on an index or join spec: one column's own value, or for
+    //"<col1> <col2> ..." the columns packed into one string by EntryCodec::pack.
+    //Packed keys go round a ring of slots, so a reference stays good for the
+    //next ring size - 1 keys read, more than a GroupProbe holds at once.
+    class RowKey {
+    public:
+        RowKey(const Table* table, const string& spec)
+        {
+            istringstream names(spec);
+            string name;
+            while (names >> name)
+                cols.push_back(table->cols.at(name));
+        }
+
+        const TableEntry& operator()(const vector<TableEntry>& row)
+        {
+            if (cols.size() == 1)
+                return row[cols[0]];
+            string key;
+            for (size_t i = 0; i < cols.size(); ++i)
+                EntryCodec::pack(key, row[cols[i]]);
+            optional<TableEntry>& slot = ring[next++ % ring.size()];
+            slot.emplace(move(key));
+            return *slot;
+        }
+
+        EntryType type(const Table* table) const
+        {
+            return cols.size() == 1 ? table->types[cols[0]] : EntryType::String;
+        }
+
+    private:
+        vector<size_t> cols;
+        array<optional<TableEntry>, 32> ring;
+        size_t next = 0;
+    };
+
+    //The rows one command sees: among the first count, those committed by version
+    struct Snapshot
+    {
+        const Rows* rows;
+        uint64_t version;
+        size_t count;
+        //No row was dead as of version, so every row below count is visible
+        bool clean;
+
+        bool visible(size_t i) const
+        {
+            return i < count && (clean || rows->alive(i, version));
+        }
+
+        //Calls f(i, row) for each visible row in order
+        template<typename F>
+        void scan(F f) const
+        {
+            rows->forEach(count, [&](size_t i, const vector<TableEntry>& row) {
+                if (clean || rows->alive(i, version))
+                    f(i, row);
+            });
+        }
+    };
+
+    //A table a reading command has pinned, with the index if it was free
+    //and covers every row of the snapshot
+    struct Pin
+    {
+        Table* table;
+        Snapshot snap;
+        //settled also means no dead rows, so index counts are exact
+        bool index, settled;
+        shared_lock<shared_mutex> reading, indexing;
+    };
+
+    //A hash table a join built over one column, with a filter over its keys
+    //once it is big enough for probes that miss to be worth skipping
+    struct JoinHash
+    {
+        unordered_map<TableEntry, vector<size_t>> map;
+        BloomFilter bloom;
+    };
+
+    //Tables shared by every session. The catalog lock guards the map itself:
+    //CREATE and REMOVE hold it alone, every other command shares it.
+    struct Database
+    {
+        shared_mutex catalog;
+        unordered_map<string, Table> tables;
+        mutex logging;
+        //Join hash tables over unindexed columns, kept until their table changes
+        JoinCache<JoinHash> joins;
+    };
+
+    //Optional ORDER BY / LIMIT clause of a PRINT
+    struct Order
+    {
+        size_t col = 0, limit = numeric_limits<size_t>::max();
+        bool sorted = false, desc = false;
+
+        bool active() const
+        {
+            return sorted || limit != numeric_limits<size_t>::max();
+        }
+    };
+    //What EXPLAIN reports about one command
+    struct Plan
+    {
+        bool execute = false; //EXPLAIN ANALYZE
+        bool phases = false;  //time build and output separately
+        string access, index;
+        size_t examined = 0, emitted = 0, buildRows = 0, buildKeys = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now(), execStart = start;
+        //Milliseconds
+        double build = 0, output = 0;
+    };
+
+    //Adds the time until it goes out of scope to *total, does nothing without one
+    class PhaseTimer {
+    public:
+        explicit PhaseTimer(double* t)
+            :total(t)
+        {
+            if (total)
+                begin = chrono::steady_clock::now();
+        }
+        PhaseTimer(const PhaseTimer&) = delete;
+        PhaseTimer& operator=(const PhaseTimer&) = delete;
+        ~PhaseTimer()
+        {
+            if (total)
+                *total += chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+        }
+
+    private:
+        double* total;
+        chrono::steady_clock::time_point begin;
+    };
+
+    bool quiet = false;
+    //Set while an EXPLAIN runs
+    Plan* plan = nullptr;
+    //Every command is timed into a histogram per command, LATENCY prints
+    //them and --replay also writes them to stderr on QUIT
+    bool replay = false;
+    map<string, LatencyHistogram> latencies;
+    //Commands slower than slowNs go to the slow log along with their text,
+    //table sizes and plan
+    shared_ptr<ofstream> slowLog;
+    uint64_t slowNs = 100000000;
+    //--trace writes Chrome trace events for each command's phases here
+    shared_ptr<Trace> trace;
+    //With statistics, predicates expected to match more than this share of
+    //rows are scanned rather than looked up in an index
+    static constexpr double scanFraction = 0.25;
+    //Join hash tables with fewer keys are probed without a Bloom filter
+    static constexpr size_t bloomKeys = size_t(1) << 14;
+    //Indexes over at least this many rows are bulk built when there are
+    //cores to share the work; one core does better inserting row by row
+    static constexpr size_t bulkRows = size_t(1) << 16;
+    //Sorts and join hash tables spill to tmpDir once they pass this many bytes
+    size_t memoryBudget = size_t(1024) << 20;
+    string tmpDir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    //--server listens here instead of reading cin
+    string socketPath;
+    //--pipeline reads cin ahead on another thread while commands run
+    bool pipeline = false;
+    //--batch runs commands on unrelated tables at once
+    bool batch = false;
+    //Commands --batch lets get ahead of the oldest one still running
+    static constexpr size_t batchWindow = 256;
+    //Readers wait for an index GENERATE is still building; --no-index-wait
+    //has them scan instead
+    bool indexWait = true;
+
+    shared_ptr<Database> db = make_shared<Database>();
+    unordered_map<string, Table>& tables = db->tables;
+    //cin and cout, or a server client's connection
+    istream& in = cin;
+    ostream& out = cout;
+    //Tables the current command reads, released when it ends
+    vector<Pin> pins;
 
     class VecLess {
     public:
+        static constexpr char op = '<';
+
         VecLess(size_t t, const TableEntry &x)
             :col(t), p(x) {}
         bool operator() (const vector<TableEntry>& temp) const
@@ -36,6 +368,10 @@ class SillyQL {
         {
             return x < p;
         }
+        const TableEntry& value() const
+        {
+            return p;
+        }
 
     private:
         size_t col;
@@ -44,6 +380,8 @@ class SillyQL {
 
     class VecEqual {
     public:
+        static constexpr char op = '=';
+
         VecEqual(size_t t, const TableEntry& x)
             :col(t), p(x) {}
         bool operator() (const vector<TableEntry>& temp) const
@@ -54,6 +392,10 @@ class SillyQL {
         {
             return x == p;
         }
+        const TableEntry& value() const
+        {
+            return p;
+        }
 
     private:
         size_t col;
@@ -62,6 +404,8 @@ class SillyQL {
 
     class VecGreater {
     public:
+        static constexpr char op = '>';
+
         VecGreater(size_t t, const TableEntry& x)
             :col(t), p(x) {}
         bool operator() (const vector<TableEntry>& temp) const
@@ -72,215 +416,791 @@ class SillyQL {
         {
             return x > p;
         }
+        const TableEntry& value() const
+        {
+            return p;
+        }
 
     private:
         size_t col;
         TableEntry p;
     };
 
+    //Matches rows equal to every value of WHERE <colname> = <value> AND <colname> = <value> ...
+    class VecEqualAll {
+    public:
+        explicit VecEqualAll(vector<pair<size_t, TableEntry>> c)
+            :conds(move(c)) {}
+        bool operator() (const vector<TableEntry>& temp) const
+        {
+            for (size_t i = 0; i < conds.size(); ++i)
+                if (!(temp[conds[i].first] == conds[i].second))
+                    return false;
+            return true;
+        }
+        //The value column col must equal, nullptr if it has no condition
+        const TableEntry* value(size_t col) const
+        {
+            for (size_t i = 0; i < conds.size(); ++i)
+                if (conds[i].first == col)
+                    return &conds[i].second;
+            return nullptr;
+        }
+
+    private:
+        vector<pair<size_t, TableEntry>> conds;
+    };
+
+    //Matches every row, used by PRINT ... ALL
+    class VecAll {
+    public:
+        bool operator() (const vector<TableEntry>&) const
+        {
+            return true;
+        }
+        bool operator() (const TableEntry&) const
+        {
+            return true;
+        }
+    };
+
+    //Orders row numbers by one column, ties broken by row number
+    class RowLess {
+    public:
+        RowLess(const Rows* e, size_t c, bool d)
+            :entries(e), col(c), desc(d) {}
+        bool operator() (size_t a, size_t b) const
+        {
+            const TableEntry& x = (*entries)[a][col];
+            const TableEntry& y = (*entries)[b][col];
+            if (x != y)
+                return desc ? x > y : x < y;
+            return a < b;
+        }
+
+    private:
+        const Rows* entries;
+        size_t col;
+        bool desc;
+    };
+
+    //Sort key followed by the printed columns, as written to sort runs
+    struct SortRow
+    {
+        vector<TableEntry> fields;
+        size_t row = 0;
+    };
+
+    class SortRowLess {
+    public:
+        explicit SortRowLess(bool d)
+            :desc(d) {}
+        bool operator() (const SortRow& a, const SortRow& b) const
+        {
+            if (a.fields[0] != b.fields[0])
+                return desc ? a.fields[0] > b.fields[0] : a.fields[0] < b.fields[0];
+            return a.row < b.row;
+        }
+
+    private:
+        bool desc;
+    };
+
+    class SortRowCodec {
+    public:
+        explicit SortRowCodec(vector<EntryType> t)
+            :types(move(t)) {}
+        size_t bytes(const SortRow& rec) const
+        {
+            size_t size = sizeof(SortRow);
+            for (const TableEntry& tt : rec.fields)
+                size += EntryCodec::bytes(tt);
+            return size;
+        }
+        void write(ostream& os, const SortRow& rec) const
+        {
+            uint64_t row = rec.row;
+            os.write(reinterpret_cast<const char*>(&row), sizeof(row));
+            for (const TableEntry& tt : rec.fields)
+                EntryCodec::write(os, tt);
+        }
+        bool read(istream& is, SortRow& rec) const
+        {
+            uint64_t row;
+            if (!is.read(reinterpret_cast<char*>(&row), sizeof(row)))
+                return false;
+            rec.row = static_cast<size_t>(row);
+            rec.fields.clear();
+            rec.fields.reserve(types.size());
+            for (EntryType type : types)
+                rec.fields.push_back(EntryCodec::read(is, type));
+            return true;
+        }
+
+    private:
+        vector<EntryType> types;
+    };
+
+    //Row numbers of a join match, ordered table1-major
+    struct JoinPair
+    {
+        size_t row1 = 0, row2 = 0;
+
+        bool operator<(const JoinPair& other) const
+        {
+            return row1 != other.row1 ? row1 < other.row1 : row2 < other.row2;
+        }
+    };
+
+    class JoinPairCodec {
+    public:
+        size_t bytes(const JoinPair&) const
+        {
+            return sizeof(JoinPair);
+        }
+        void write(ostream& os, const JoinPair& rec) const
+        {
+            uint64_t rows[2] = { rec.row1, rec.row2 };
+            os.write(reinterpret_cast<const char*>(rows), sizeof(rows));
+        }
+        bool read(istream& is, JoinPair& rec) const
+        {
+            uint64_t rows[2];
+            if (!is.read(reinterpret_cast<char*>(rows), sizeof(rows)))
+                return false;
+            rec.row1 = static_cast<size_t>(rows[0]);
+            rec.row2 = static_cast<size_t>(rows[1]);
+            return true;
+        }
+    };
+
 public:
+    SillyQL() = default;
+
+    //A server session: same options and tables as server, its own streams
+    SillyQL(const SillyQL& server, istream& is, ostream& os)
+        :quiet(server.quiet), replay(server.replay), slowLog(server.slowLog), slowNs(server.slowNs),
+        trace(server.trace), memoryBudget(server.memoryBudget), tmpDir(server.tmpDir), indexWait(server.indexWait), db(server.db), in(is), out(os)
+    {
+    }
+
     void getOptions(int argc, char** argv)
     {
         int option_index = 0, option = 0;
 
         struct option longOpts[] = { {"quiet", no_argument, nullptr, 'q' },
                                     {"help", no_argument, nullptr, 'h'},
+                                    {"memory", required_argument, nullptr, 'm'},
+                                    {"tmpdir", required_argument, nullptr, 't'},
+                                    {"replay", no_argument, nullptr, 'r'},
+                                    {"slow-log", required_argument, nullptr, 's'},
+                                    {"slow-ms", required_argument, nullptr, 'S'},
+                                    {"trace", required_argument, nullptr, 'T'},
+                                    {"server", required_argument, nullptr, 'u'},
+                                    {"pipeline", no_argument, nullptr, 'p'},
+                                    {"batch", no_argument, nullptr, 'b'},
+                                    {"join-cache", required_argument, nullptr, 'j'},
+                                    {"no-index-wait", no_argument, nullptr, 'n'},
                                     { nullptr, 0, nullptr, '\0' } };
 
-        while ((option = getopt_long(argc, argv, "qh", longOpts, &option_index)) != -1) {
+        while ((option = getopt_long(argc, argv, "qhm:t:rs:S:T:u:pbj:n", longOpts, &option_index)) != -1) {
             switch (option) {
             case 'q':
                 quiet = true;
                 break;
 
-            case 'h':
-                cout << "Command line options: -q or -h";
-                exit(0);
+            case 'm':
+                memoryBudget = static_cast<size_t>(strtoull(optarg, nullptr, 10)) << 20;
+                break;
 
-            default:
-                exit(1);
-            }
-        }
-    }
+            case 't':
+                tmpDir = optarg;
+                break;
 
-    void readCommands()
-    {
-        size_t count = 0;
-        string trash, cmd;
-        do
-        {
-            ++count;
-            cout << "% ";
-            cin >> cmd;
-            switch (cmd[0])
-            {
-            case '#':
-                getline(cin, trash);
+            case 'r':
+                replay = true;
                 break;
 
-            case 'Q':
-                quit();
-                return;
+            case 's':
+                slowLog.reset(new ofstream(optarg, ios::app));
+                if (!*slowLog)
+                {
+                    cerr << "Error: cannot open slow log " << optarg << "\n";
+                    exit(1);
+                }
+                break;
 
-            case 'C':
-                create();
+            case 'S':
+                slowNs = static_cast<uint64_t>(strtod(optarg, nullptr) * 1e6);
                 break;
 
-            case 'I':
-                insert();
+            case 'T':
+                trace.reset(new Trace(optarg));
+                Trace::active() = trace.get();
                 break;
 
-            case 'R':
-                remove();
+            case 'u':
+                socketPath = optarg;
                 break;
 
-            case 'P':
-                print();
+            case 'p':
+                pipeline = true;
                 break;
 
-            case 'D':
-                deleteRows();
+            case 'b':
+                batch = true;
                 break;
 
-            case 'J':
-                join();
+            case 'j':
+                db->joins.setBudget(static_cast<size_t>(strtoull(optarg, nullptr, 10)) << 20);
                 break;
 
-            case 'G':
-                generate();
+            case 'n':
+                indexWait = false;
                 break;
 
+            case 'h':
+                out << "Command line options: -q, -m <MiB>, -t <dir>, -r, -s <file>, -S <ms>, -T <file>, -u <socket>, -p, -b, -j <MiB>, -n or -h";
+                exit(0);
+
             default:
-                cout << "Error: unrecognized command\n";
-                getline(cin, trash);
+                exit(1);
             }
-        } while (cmd != "QUIT");
+        }
     }
 
-private:
-
-    void create()
+    void readCommands()
     {
-        string name, temp, type;
-        size_t num;
-        cin >> name;
-        if (tables.find(name) != tables.end())
+        if (!socketPath.empty())
         {
-            cout << "Error: Cannot create already existing table " << name << "\n";
-            getline(cin, name);
+            serve();
             return;
         }
-        cin >> num;
-        Table* table = &tables[name];
-        table->name = name;
-        table->types.reserve(num);
-        //Adds column types
-        for (size_t i = 0; i < num; ++i)
+        size_t count = 0;
+        string cmd;
+        streambuf* input = in.rdbuf();
+        streambuf* source = input;
+        unique_ptr<ReadAhead> ahead;
+        if (pipeline)
         {
-            cin >> type;
-            switch (type[0])
-            {
-            case 's':
-                table->types.push_back(EntryType::String);
+            ahead.reset(new ReadAhead(input));
+            source = ahead.get();
+            in.rdbuf(source);
+        }
+        if (batch)
+        {
+            runBatch();
+            in.rdbuf(input);
+            return;
+        }
+        //The slow log needs the command text, so input goes through a CaptureBuf
+        unique_ptr<CaptureBuf> capture;
+        if (slowLog)
+        {
+            capture.reset(new CaptureBuf(source, 256));
+            in.rdbuf(capture.get());
+        }
+        do
+        {
+            ++count;
+            out << "% ";
+            if (capture)
+                capture->start();
+            //A client can hang up without QUIT
+            if (!(in >> cmd))
                 break;
-
-            case 'b':
-                table->types.push_back(EntryType::Bool);
+            if (!runCommand(cmd, capture.get()))
                 break;
+        } while (cmd != "QUIT");
+        in.rdbuf(input);
+    }
 
-            case 'i':
-                table->types.push_back(EntryType::Int);
-                break;
+private:
 
-            case 'd':
-                table->types.push_back(EntryType::Double);
-                break;
+    //Runs the command named by cmd, whose first word has been read. Returns
+    //false for QUIT.
+    bool runCommand(const string& cmd, CaptureBuf* capture)
+    {
+        string trash;
+        Plan current;
+        current.execute = true;
+        //The slow log and trace both want the plan of every command
+        if (capture || trace)
+            plan = &current;
+        auto start = chrono::steady_clock::now();
+        current.start = current.execStart = start;
+        bool timed = true;
+        //CREATE and REMOVE take the catalog alone once they have read their
+        //arguments, so a slow client doesn't hold up every other session
+        shared_lock<shared_mutex> catalog(db->catalog, defer_lock);
+        if (cmd[0] != 'C' && cmd[0] != 'R')
+            catalog.lock();
+        switch (cmd[0])
+        {
+        case '#':
+            getline(in, trash);
+            timed = false;
+            break;
+
+        case 'Q':
+            quit();
+            plan = nullptr;
+            return false;
+
+        case 'C':
+            create();
+            break;
+
+        case 'I':
+            insert();
+            break;
+
+        case 'R':
+            remove();
+            break;
+
+        case 'P':
+            print();
+            break;
+
+        case 'D':
+            deleteRows();
+            break;
+
+        case 'J':
+            join();
+            break;
+
+        case 'G':
+            generate();
+            break;
+
+        case 'A':
+            analyze();
+            break;
+
+        case 'E':
+            explain();
+            break;
+
+        case 'S':
+            if (cmd == "STATUS")
+                status();
+            else
+                stats();
+            break;
+
+        case 'L':
+            printLatencies(out);
+            getline(in, trash);
+            break;
+
+        default:
+            out << "Error: unrecognized command\n";
+            getline(in, trash);
+            timed = false;
+        }
+        plan = nullptr;
+        pins.clear();
+        if (trace)
+        {
+            {
+                TraceSpan span("output flush", "output");
+                out.flush();
             }
+            trace->complete(cmd, "command", start, chrono::steady_clock::now());
         }
-        cout << "New table " << name << " with column(s) ";
-        //Adds column names
-        for (size_t i = 0; i < num; ++i)
+        if (timed)
         {
-            cin >> temp;
-            table->cols[temp] = i;
-            cout << temp << " ";
+            uint64_t ns = static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+            latencies[cmd].record(ns);
+            if (capture && ns >= slowNs)
+                logSlow(capture->take(), ns, current);
         }
-        cout << "created\n";
-        return;
+        return true;
     }
 
-    void insert()
+    //Runs the commands left in in, as readCommands does but without a
+    //prompt after the last one. Returns false after a QUIT.
+    bool runUnit()
     {
-        string name, trash, sVal;
-        int iVal;
-        double dVal;
-        bool bVal;
-        size_t start, num, numCols;
-        cin >> trash >> name >> num;
-        if (tables.find(name) == tables.end())
+        unique_ptr<CaptureBuf> capture;
+        streambuf* input = in.rdbuf();
+        if (slowLog)
         {
-            cout << "Error: " << name << " does not name a table in the database\n";
-            getline(cin, trash);
-            for (size_t i = 0; i < num; ++i)
-                getline(cin, trash);
-            return;
+            capture.reset(new CaptureBuf(input, 256));
+            in.rdbuf(capture.get());
         }
-        cin >> trash;
-        Table* table = &tables[name];
-        start = table->entries.size();
-        table->entries.reserve(start + num);
-        numCols = table->cols.size();
-        for (size_t i = start; i < start + num; ++i)
+        string cmd;
+        bool more = true;
+        while (more && (in >> ws) && in.peek() != EOF)
         {
-            vector<TableEntry> temp;
-            temp.reserve(numCols);
-            for (size_t j = 0; j < numCols; ++j)
+            out << "% ";
+            if (capture)
+                capture->start();
+            if (!(in >> cmd))
+                break;
+            more = runCommand(cmd, capture.get());
+        }
+        in.rdbuf(input);
+        return more;
+    }
+
+    //One command of a --batch script, with its row lines for an INSERT
+    struct BatchTask
+    {
+        string text;
+        string output;
+        map<string, LatencyHistogram> latencies;
+        //Earlier tasks on its tables still to finish
+        size_t waiting = 0;
+        vector<shared_ptr<BatchTask>> dependents;
+        bool finished = false, quit = false;
+    };
+
+    //The task that last wrote a table and those that read it since
+    struct TableAccess
+    {
+        shared_ptr<BatchTask> writer;
+        vector<shared_ptr<BatchTask>> readers;
+    };
+
+    //--batch: every command waits for the earlier ones that write a table it
+    //uses, and a write also for the earlier reads, so each sees the tables
+    //as the serial order would. Commands otherwise run at once on a
+    //TaskPool, each in its own session, and their output is printed in
+    //script order. LATENCY, QUIT and STATS of every table wait for all
+    //before them and run here.
+    void runBatch()
+    {
+        mutex mtx;
+        condition_variable finished;
+        unordered_map<string, TableAccess> access;
+        deque<shared_ptr<BatchTask>> order;
+        //Declared before the pool, which may still be calling it as it winds down
+        function<void(shared_ptr<BatchTask>)> run;
+        TaskPool pool;
+        run = [&](shared_ptr<BatchTask> task) {
+            istringstream is(task->text);
+            ostringstream os;
+            is >> boolalpha;
+            os << boolalpha;
+            SillyQL session(*this, is, os);
+            task->quit = !session.runUnit();
+            task->output = os.str();
+            task->latencies = move(session.latencies);
+
+            lock_guard<mutex> lock(mtx);
+            task->finished = true;
+            for (size_t i = 0; i < task->dependents.size(); ++i)
             {
-                switch (table->types[j])
+                shared_ptr<BatchTask> next = task->dependents[i];
+                if (--next->waiting == 0)
+                    pool.submit([&run, next]() { run(next); });
+            }
+            task->dependents.clear();
+            finished.notify_all();
+        };
+        //Prints finished tasks in order, waiting while more than limit are
+        //left. Returns false once a task quit.
+        auto flush = [&](size_t limit) {
+            while (!order.empty())
+            {
+                shared_ptr<BatchTask> task = order.front();
                 {
-                case EntryType::Bool:
-                    cin >> bVal;
-                    temp.emplace_back(bVal);
-                    break;
+                    unique_lock<mutex> lock(mtx);
+                    if (order.size() > limit)
+                        finished.wait(lock, [&task]() { return task->finished; });
+                    else if (!task->finished)
+                        return true;
+                }
+                out << task->output;
+                for (auto it = task->latencies.begin(); it != task->latencies.end(); ++it)
+                    latencies[it->first].merge(it->second);
+                order.pop_front();
+                if (task->quit)
+                    return false;
+            }
+            return true;
+        };
 
-                case EntryType::Double:
-                    cin >> dVal;
-                    temp.emplace_back(dVal);
-                    break;
+        string line, first, text;
+        size_t rows;
+        while (getline(in, line))
+        {
+            ReadAhead::command(line, first, rows);
+            if (first.empty())
+                continue;
+            vector<string> names;
+            if (first[0] != '#')
+                names = commandTables(line);
+            bool writes = commandWrites(line);
+            text = line + "\n";
+            for (; rows > 0 && getline(in, line); --rows)
+                text += line + "\n";
+
+            if (first[0] == 'Q' || first[0] == 'L' || (first[0] == 'S' && names.empty()))
+            {
+                if (!flush(0))
+                    return;
+                access.clear();
+                istringstream unit(text);
+                streambuf* input = in.rdbuf(unit.rdbuf());
+                bool more = runUnit();
+                in.rdbuf(input);
+                if (!more)
+                    return;
+                continue;
+            }
 
-                case EntryType::Int:
-                    cin >> iVal;
-                    temp.emplace_back(iVal);
-                    break;
+            shared_ptr<BatchTask> task = make_shared<BatchTask>();
+            task->text = move(text);
+            {
+                lock_guard<mutex> lock(mtx);
+                auto after = [&task](const shared_ptr<BatchTask>& before) {
+                    if (before && !before->finished)
+                    {
+                        ++task->waiting;
+                        before->dependents.push_back(task);
+                    }
+                };
+                for (size_t i = 0; i < names.size(); ++i)
+                {
+                    TableAccess& a = access[names[i]];
+                    after(a.writer);
+                    if (writes)
+                    {
+                        for (size_t j = 0; j < a.readers.size(); ++j)
+                            after(a.readers[j]);
+                        a.readers.clear();
+                        a.writer = task;
+                    }
+                    else
+                    {
+                        a.readers.erase(remove_if(a.readers.begin(), a.readers.end(),
+                            [](const shared_ptr<BatchTask>& r) { return r->finished; }), a.readers.end());
+                        a.readers.push_back(task);
+                    }
+                }
+                if (task->waiting == 0)
+                    pool.submit([&run, task]() { run(task); });
+            }
+            order.push_back(task);
+            if (!flush(batchWindow))
+                return;
+        }
+        if (flush(0))
+            out << "% ";
+    }
 
-                case EntryType::String:
-                    cin >> sVal;
-                    temp.emplace_back(sVal);
-                    break;
+    //Whether a command line changes the tables it names
+    static bool commandWrites(const string& line)
+    {
+        istringstream stream(line);
+        string word;
+        stream >> word;
+        if (word == "EXPLAIN")
+        {
+            //Only EXPLAIN ANALYZE runs the command
+            stream >> word;
+            if (word != "ANALYZE")
+                return false;
+            stream >> word;
+        }
+        return !word.empty() && string("IDGACR").find(word[0]) != string::npos;
+    }
+
+    //Accepts clients on socketPath until killed, each on its own thread with
+    //its own session over the shared tables
+    void serve()
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (fd == -1 || socketPath.size() >= sizeof(addr.sun_path))
+        {
+            cerr << "Error: cannot listen on " << socketPath << "\n";
+            exit(1);
+        }
+        strcpy(addr.sun_path, socketPath.c_str());
+        unlink(socketPath.c_str());
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1)
+        {
+            cerr << "Error: cannot listen on " << socketPath << ": " << strerror(errno) << "\n";
+            exit(1);
+        }
+        //Writes to a client that hung up fail instead of killing the server
+        signal(SIGPIPE, SIG_IGN);
+        cerr << "Listening on " << socketPath << "\n";
+        while (true)
+        {
+            int client = accept(fd, nullptr, nullptr);
+            if (client == -1)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                break;
+            }
+            thread([this, client]() {
+                {
+                    FdBuf buf(client);
+                    istream is(&buf);
+                    ostream os(&buf);
+                    is >> boolalpha;
+                    os << boolalpha;
+                    //The prompt and results go out before the session waits on the client
+                    is.tie(&os);
+                    SillyQL session(*this, is, os);
+                    session.readCommands();
                 }
+                close(client);
+            }).detach();
+        }
+        close(fd);
+        unlink(socketPath.c_str());
+    }
+
+    void create()
+    {
+        string name, type;
+        size_t num = 0;
+        in >> name >> num;
+        vector<EntryType> types;
+        vector<string> colNames(num);
+        types.reserve(num);
+        //Adds column types
+        for (size_t i = 0; i < num; ++i)
+        {
+            in >> type;
+            switch (type[0])
+            {
+            case 's':
+                types.push_back(EntryType::String);
+                break;
+
+            case 'b':
+                types.push_back(EntryType::Bool);
+                break;
+
+            case 'i':
+                types.push_back(EntryType::Int);
+                break;
+
+            case 'd':
+                types.push_back(EntryType::Double);
+                break;
             }
-            if (!table->hash.empty())
-                table->hash[temp[table->cols[table->index]]].push_back(i);
-            else if (!table->bst.empty())
-                table->bst[temp[table->cols[table->index]]].push_back(i);
+        }
+        for (size_t i = 0; i < num; ++i)
+            in >> colNames[i];
+
+        unique_lock<shared_mutex> schema(db->catalog);
+        if (tables.find(name) != tables.end())
+        {
+            out << "Error: Cannot create already existing table " << name << "\n";
+            return;
+        }
+        Table* table = &tables[name];
+        table->name = name;
+        table->types = move(types);
+        out << "New table " << name << " with column(s) ";
+        //Adds column names
+        for (size_t i = 0; i < num; ++i)
+        {
+            table->cols[colNames[i]] = i;
+            out << colNames[i] << " ";
+        }
+        out << "created\n";
+        return;
+    }
+
+    void insert()
+    {
+        string name, trash;
+        size_t start, num;
+        in >> trash >> name >> num;
+        if (tables.find(name) == tables.end())
+        {
+            out << "Error: " << name << " does not name a table in the database\n";
+            getline(in, trash);
+            for (size_t i = 0; i < num; ++i)
+                getline(in, trash);
+            return;
+        }
+        in >> trash;
+        Table* table = &tables[name];
+        //Rows are read before taking the table so a slow client doesn't block it
+        vector<vector<TableEntry>> rows;
+        rows.reserve(num);
+        {
+            TraceSpan span("ingest", "parse");
+            for (size_t i = 0; i < num; ++i)
+                rows.push_back(readRow(table->types));
+        }
+
+        lock_guard<mutex> writing(table->writer);
+        uint64_t version = table->committed + 1;
+        //Positions are reported as they will be once dead rows, all below the
+        //new ones, are reclaimed, even while a build or a reader defers that
+        start = table->entries.size() - table->dead;
+        table->entries.reserve(table->entries.size() + num);
+        for (size_t i = 0; i < num; ++i)
+            table->entries.push_back(move(rows[i]), version);
+        table->committed = version;
+        maintain(table);
+        out << "Added " << num << " rows to " << name << " from position " << start << " to " << start + num - 1 << "\n";
+    }
+
+    vector<TableEntry> readRow(const vector<EntryType>& types)
+    {
+        string sVal;
+        int iVal;
+        double dVal;
+        bool bVal;
+        vector<TableEntry> temp;
+        temp.reserve(types.size());
+        for (size_t j = 0; j < types.size(); ++j)
+        {
+            switch (types[j])
+            {
+            case EntryType::Bool:
+                in >> bVal;
+                temp.emplace_back(bVal);
+                break;
+
+            case EntryType::Double:
+                in >> dVal;
+                temp.emplace_back(dVal);
+                break;
 
-            table->entries.push_back(temp);
+            case EntryType::Int:
+                in >> iVal;
+                temp.emplace_back(iVal);
+                break;
+
+            case EntryType::String:
+                in >> sVal;
+                temp.emplace_back(sVal);
+                break;
+            }
         }
-        cout << "Added " << num << " rows to " << name << " from position " << start << " to " << start + num - 1 << "\n";
-        assert(table->hash.empty() || table->bst.empty());
+        return temp;
     }
 
     void remove()
     {
         string name;
-        cin >> name;
+        in >> name;
+        unique_lock<shared_mutex> schema(db->catalog);
         if (tables.find(name) == tables.end())
         {
-            cout << "Error: " << name << " does not name a table in the database\n";
+            out << "Error: " << name << " does not name a table in the database\n";
             return;
         }
         tables.erase(name);
-        cout << "Table " << name << " deleted\n";
+        db->joins.erase(name);
+        out << "Table " << name << " deleted\n";
     }
 
     void print()
@@ -288,27 +1208,28 @@ private:
         string name, colName, command;
         size_t num;
         
-        cin >> name >> name; //from <tablename>
+        in >> name >> name; //from <tablename>
         if (tables.find(name) == tables.end())
         {
-            cout << "Error: " << name << " does not name a table in the database\n";
-            getline(cin, name);
+            out << "Error: " << name << " does not name a table in the database\n";
+            getline(in, name);
             return;
         }
-        cin >> num;
+        in >> num;
         vector<size_t> indexes;
         vector<string> colNames;
         indexes.reserve(num);
         colNames.reserve(num);
         Table* table = &tables[name];
+        pin(table);
         for (size_t i = 0; i < table->cols.size(); ++i)
         {
-            cin >> colName;
+            in >> colName;
             auto it = table->cols.find(colName);
             if (it == table->cols.end())
             {
-                cout << "Error: " << colName << " does not name a column in " << name << "\n";
-                getline(cin, name);
+                out << "Error: " << colName << " does not name a column in " << name << "\n";
+                getline(in, name);
                 return;
             }
             colNames.push_back(colName);
@@ -316,366 +1237,1420 @@ private:
             if (colNames.size() == num)
                 break;
         }
-        cin >> command;
+        in >> command;
         if (command == "ALL")
         {
-            if (!quiet)
-                printAll(indexes, colNames, table);
+            Order order;
+            if (readOrder(table, order))
+                return;
+            if (order.active())
+            {
+                printHeader(colNames);
+                printOrdered(table, indexes, VecAll(), order);
+                return;
+            }
+            if (choose("full scan"))
+                return;
+            size_t count = printAll(indexes, colNames, table);
 
-            cout << "Printed " << table->entries.size() << " matching rows from " << name << "\n";
+            out << "Printed " << count << " matching rows from " << name << "\n";
+            done(snapshot(table).count, count);
         }
         else
             printWhere(indexes, colNames, table);
     }
 
-    void printAll(const vector<size_t>& indexes, const vector<string> &colNames, Table* table)
+    //Returns the number of rows in the snapshot
+    size_t printAll(const vector<size_t>& indexes, const vector<string> &colNames, Table* table)
     {
-        //Prints colNames
-        for (size_t i = 0; i < colNames.size(); ++i)
-        {
-            cout << colNames[i] << " ";
-        }
-        cout << "\n";
+        printHeader(colNames);
 
         //Prints rows
-        for (size_t i = 0; i < table->entries.size(); ++i)
-        {
-            for (size_t j = 0; j < indexes.size(); ++j)
-            {
-                cout << table->entries[i][indexes[j]] << " ";
-            }
-            cout << "\n";
-        }
+        Snapshot snap = snapshot(table);
+        size_t count = 0;
+        snap.scan([&](size_t i, const vector<TableEntry>&) {
+            ++count;
+            if (!quiet)
+                printRow(table, indexes, i);
+        });
+        return count;
     }
 
     void printWhere(const vector<size_t>& indexes, const vector<string> &colNames,Table* table)
     {
         string col;
-        cin >> col;
+        in >> col;
         if (table->cols.find(col) == table->cols.end())
         {
-            cout << "Error: " << col << " does not name a column in " << table->name << "\n";
-            getline(cin, col);
+            out << "Error: " << col << " does not name a column in " << table->name << "\n";
+            getline(in, col);
             return;
         }
 
-        if (!quiet)
+        calcRows(table, indexes, colNames, col, true);
+    }
+
+    void printHeader(const vector<string>& colNames)
+    {
+        if (quiet || dryRun())
+            return;
+        //Prints colNames
+        for (size_t i = 0; i < colNames.size(); ++i)
+        {
+            out << colNames[i] << " ";
+        }
+        out << "\n";
+    }
+
+    //Reads [ORDER BY <colname> [ASC|DESC]] [LIMIT <k>] off the rest of the line
+    //Returns true on an error
+    bool readOrder(Table* table, Order& order)
+    {
+        string rest;
+        getline(in, rest);
+        istringstream line(rest);
+        return readOrder(table, order, line);
+    }
+
+    bool readOrder(Table* table, Order& order, istream& line)
+    {
+        string word;
+        while (line >> word)
         {
-            //Prints colNames
-            for (size_t i = 0; i < colNames.size(); ++i)
+            if (word == "ORDER")
+            {
+                line >> word >> word; //BY <colname>
+                auto it = table->cols.find(word);
+                if (it == table->cols.end())
+                {
+                    out << "Error: " << word << " does not name a column in " << table->name << "\n";
+                    return true;
+                }
+                order.sorted = true;
+                order.col = it->second;
+            }
+            else if (word == "DESC" || word == "ASC")
+                order.desc = word == "DESC";
+            else if (word == "LIMIT")
+                line >> order.limit;
+            else
             {
-                cout << colNames[i] << " ";
+                out << "Error: unrecognized command\n";
+                return true;
             }
-            cout << "\n";
         }
-
-        calcRows(table, indexes, col, true);
+        return false;
     }
 
     void deleteRows()
     {
         string trash, col, name;
 
-        cin >> trash >> name;
+        in >> trash >> name;
         if (tables.find(name) == tables.end())
         {
-            cout << "Error: " << name << " does not name a table in the database\n";
-            getline(cin, name);
+            out << "Error: " << name << " does not name a table in the database\n";
+            getline(in, name);
             return;
         }
 
         Table* table = &tables[name];
-        cin >> trash >> col;
-        if (table->cols.find(col) == table->cols.end())
+        //The whole condition is read before taking the table, so a slow
+        //client doesn't hold up its writers, then parsed from that line
+        string rest;
+        getline(in, rest);
+        ios_base::iostate state = in.rdstate();
+        istringstream line(rest);
+        streambuf* input = in.rdbuf(line.rdbuf());
         {
-            cout << "Error: " << col << " does not name a column in " << name << "\n";
-            getline(cin, col);
-            return;
+            lock_guard<mutex> writing(table->writer);
+            in >> trash >> col;
+            if (table->cols.find(col) == table->cols.end())
+                out << "Error: " << col << " does not name a column in " << name << "\n";
+            else
+            {
+                awaitIndex(table);
+                calcRows(table, col, false);
+            }
         }
-
-        calcRows(table, col, false);
+        in.rdbuf(input);
+        in.clear(state);
     }
 
     void join()
     {
         //Pair = {table, printCol}
         vector<pair<string, string>> cols;
-        string name1, name2, col1, col2, trash, printCol;
+        string name1, name2, col1, col2, op, trash, printCol;
         size_t num, printNum;
 
-        cin >> name1;
+        in >> name1;
         if (tables.find(name1) == tables.end())
         {
-            cout << "Error: " << name1 << " does not name a table in the database\n";
-            getline(cin, trash);
+            out << "Error: " << name1 << " does not name a table in the database\n";
+            getline(in, trash);
             return;
         }
 
-        cin >> trash >> name2;
+        in >> trash >> name2;
         if (tables.find(name2) == tables.end())
         {
-            cout << "Error: " << name2 << " does not name a table in the database\n";
-            getline(cin, trash);
+            out << "Error: " << name2 << " does not name a table in the database\n";
+            getline(in, trash);
             return;
         }
 
-        cin >> trash >> col1;
+        in >> trash >> col1;
         Table* table1 = &tables[name1];
         Table* table2 = &tables[name2];
+        //In address order, so no two joins pin the same pair the other way round
+        pin(min(table1, table2, less<Table*>()));
+        pin(max(table1, table2, less<Table*>()));
         if (table1->cols.find(col1) == table1->cols.end())
         {
-            cout << "Error: " << col1 << " does not name a column in " << name1 << "\n";
-            getline(cin, trash);
+            out << "Error: " << col1 << " does not name a column in " << name1 << "\n";
+            getline(in, trash);
             return;
         }
 
-        cin >> trash >> col2;
+        in >> op >> col2;
         if (table2->cols.find(col2) == table2->cols.end())
         {
-            cout << "Error: " << col2 << " does not name a column in " << name2 << "\n";
-            getline(cin, trash);
+            out << "Error: " << col2 << " does not name a column in " << name2 << "\n";
+            getline(in, trash);
             return;
         }
 
-        cin >> trash >> trash >> num;
+        //Further AND <colname1> = <colname2> pairs make a composite key
+        string next, op2, next2;
+        in >> trash >> next;
+        while (in && next != "PRINT")
+        {
+            in >> op2 >> next2;
+            if (table1->cols.find(next) == table1->cols.end() || table2->cols.find(next2) == table2->cols.end())
+            {
+                out << "Error: " << (table1->cols.find(next) == table1->cols.end() ? next + " does not name a column in " + name1
+                                     : next2 + " does not name a column in " + name2) << "\n";
+                getline(in, trash);
+                return;
+            }
+            if (op != "=" || op2 != "=")
+            {
+                out << "Error: only = conditions can be combined with AND\n";
+                getline(in, trash);
+                return;
+            }
+            col1 += " " + next;
+            col2 += " " + next2;
+            in >> trash >> next;
+        }
+
+        in >> num;
         cols.reserve(num);
 
         //Checks cols to make sure they exist
         for (size_t i = 0; i < num; ++i)
         {
-            cin >> printCol >> printNum;
+            in >> printCol >> printNum;
             if (checkCol(table1, table2, cols, printCol, printNum))
                 return;
         }
 
-        joinAlgo(table1, table2, cols, col1, col2);
+        joinAlgo(table1, table2, cols, col1, col2, op[0]);
     }
 
     void generate()
     {
         string trash, name, type, col;
 
-        cin >> trash >> name;
+        in >> trash >> name;
         if (tables.find(name) == tables.end())
         {
-            cout << "Error: " << name << " does not name a table in the database\n";
-            getline(cin, trash);
+            out << "Error: " << name << " does not name a table in the database\n";
+            getline(in, trash);
             return;
         }
 
         Table* table = &tables[name];
-        cin >> type >> trash >> trash >> col;
-        if (table->cols.find(col) == table->cols.end())
+        in >> type >> trash >> trash;
+        //ON <colname> [<colname> ...] to the end of the line; several make a
+        //composite index keyed on the columns packed together in that order.
+        //Read before taking the table, so a slow client doesn't hold up its writers.
+        string rest, cols;
+        getline(in, rest);
+        lock_guard<mutex> writing(table->writer);
+        istringstream line(rest);
+        while (line >> col)
+        {
+            if (table->cols.find(col) == table->cols.end())
+            {
+                out << "Error: " << col << " does not name a column in " << name << "\n";
+                return;
+            }
+            cols += (cols.empty() ? "" : " ") + col;
+        }
+        if (cols.empty())
         {
-            cout << "Error: " << col << " does not name a column in " << name << "\n";
-            getline(cin, trash);
+            out << "Error: no column to index\n";
             return;
         }
 
-        if (type == "hash")
+        if (!table->building || table->building->type != type || table->building->col != cols)
         {
-            if (!table->bst.empty())
-            {
-                table->bst.clear();
-                Hash(table, col);
-            }
-            else if (!table->hash.empty())
+            //A build this one replaces is set aside to finish on its own
+            //thread, so the GENERATE doesn't wait for it
+            if (table->building)
             {
-                //If a hash for that column already exists do nothing
-                if (table->index != col)
-                {
-                    Hash(table, col);
-                }
+                lock_guard<mutex> swapping(table->buildLock);
+                table->abandoned.push_back(move(table->building));
             }
-            //Neither exist
-            else
-                Hash(table, col);
+            bool exists = type == "hash" ? !table->hash.empty() : !table->bst.empty();
+            if (!exists || table->index != cols)
+                startBuild(table, type, cols);
         }
-        else
+        out << "Created " << type << " index for table " << name << (cols == col ? " on column " : " on columns ") << cols << "\n";
+    }
+
+    //Builds the index on another thread; readers wait for it or scan. The
+    //old index goes now unless a reader has it, then it stays in use until
+    //the install. Reclaiming dead rows waits for the install, so the rows
+    //the build indexes keep their positions.
+    void startBuild(Table* table, const string& type, const string& col)
+    {
         {
-            if (!table->hash.empty())
+            unique_lock<shared_mutex> indexing(table->indexLock, try_to_lock);
+            if (indexing)
             {
                 table->hash.clear();
-                BST(table, col);
+                table->bloom = BloomFilter();
+                table->bst.clear();
+                table->rank.invalidate();
             }
-            else if (!table->bst.empty())
+        }
+        unique_ptr<IndexBuild> build(new IndexBuild);
+        build->type = type;
+        build->col = col;
+        build->rows = table->entries.size();
+        build->buckets = table->hash.bucket_count();
+        IndexBuild* b = build.get();
+        b->worker = thread([table, b]() {
+            TraceSpan span(b->type == "hash" ? "Hash" : "BST", "build");
+            if (b->type == "hash")
             {
-                //If a bst for that column already exists do nothing
-                if (table->index != col)
-                {
-                    BST(table, col);
-                }
+                b->hash.rehash(b->buckets);
+                fillHash(table, b->col, b->rows, b->hash, &b->progress);
+                b->bloom = bloomOf(b->hash);
             }
-            //Neither exist
             else
-                BST(table, col);
-        }
-        cout << "Created " << type << " index for table " << name << " on column " << col << "\n";
-        assert(table->bst.empty() || table->hash.empty());
-    }
-
-    void quit()
-    {
-        cout << "Thanks for being silly!\n";
+                fillBST(table, b->col, b->rows, b->bst, &b->progress);
+            b->progress = b->rows;
+            b->finished.set_value();
+        });
+        lock_guard<mutex> swapping(table->buildLock);
+        table->building = move(build);
     }
 
-    void calcRows(Table* table, const vector<size_t>& indexes, const string& col, bool print)
+    //Swaps a finished build in for the index. Needs the writer lock and the
+    //index lock alone.
+    void install(Table* table)
     {
-        string sVal;
-        double dVal;
-        int iVal;
-        bool bVal;
-        char op;
-        cin >> op;
-        switch (table->types[table->cols[col]])
+        unique_ptr<IndexBuild> build;
         {
-        case EntryType::Bool:
-            cin >> bVal;
-            split3(table, indexes, TableEntry(bVal), col, print, op);
-            break;
-        case EntryType::Double:
-            cin >> dVal;
-            split3(table, indexes, TableEntry(dVal), col, print, op);
-            break;
-        case EntryType::Int:
-            cin >> iVal;
-            split3(table, indexes, TableEntry(iVal), col, print, op);
-            break;
-        case EntryType::String:
-            cin >> sVal;
-            split3(table, indexes, TableEntry(sVal), col, print, op);
-            break;
+            lock_guard<mutex> swapping(table->buildLock);
+            build = move(table->building);
         }
+        table->hash = move(build->hash);
+        table->bloom = move(build->bloom);
+        table->bst = move(build->bst);
+        table->rank.invalidate();
+        table->index = build->col;
+        table->indexed = build->rows;
+        assert(table->bst.empty() || table->hash.empty());
     }
 
-    //Remove does not need a vector
-    void calcRows(Table* table, const string& col, bool print)
+    //Waits for a GENERATE still building on table and installs its index,
+    //unless --no-index-wait. Needs the writer lock.
+    void awaitIndex(Table* table)
     {
-        vector<size_t> temp(0);
-        calcRows(table, temp, col, print);
+        if (!indexWait || !table->building)
+            return;
+        {
+            TraceSpan span("index wait", "build");
+            table->building->done.wait();
+        }
+        maintain(table);
     }
 
-    //Splits for bool
-    void split3(Table* table, const vector<size_t>& indexes, const TableEntry& temp, const string& col, bool print, char op)
+    void analyze()
     {
-        auto column = table->cols.find(col);
-
-        switch (op)
-        {
-        case '<':
+        string name;
+        in >> name;
+        if (tables.find(name) == tables.end())
         {
-            if (print)
-            {
-                calcRowHelp(table, indexes, col, VecLess(column->second, temp));
-            }
-            else
-                removeRow(table, VecLess(column->second, temp));
-            break;
+            out << "Error: " << name << " does not name a table in the database\n";
+            getline(in, name);
+            return;
         }
 
-        case '=':
+        Table* table = &tables[name];
+        lock_guard<mutex> writing(table->writer);
+        vector<string> colNames(table->cols.size());
+        for (auto it = table->cols.begin(); it != table->cols.end(); ++it)
+            colNames[it->second] = it->first;
+
+        Snapshot snap = snapshot(table);
+        vector<ColumnStats> stats(colNames.size());
+        vector<const TableEntry*> values;
+        values.reserve(snap.count);
+        for (size_t j = 0; j < colNames.size(); ++j)
         {
-            if (print)
-            {
-                calcRowHelp(table, indexes, col, VecEqual(column->second, temp));
-            }
-            else
-                removeRow(table, VecEqual(column->second, temp));
-            break;
+            values.clear();
+            snap.scan([&](size_t, const vector<TableEntry>& row) {
+                values.push_back(&row[j]);
+            });
+            stats[j].analyze(values);
         }
 
-        case '>':
-            if (print)
+        if (!quiet)
+        {
+            out << "column distinct min max \n";
+            for (size_t j = 0; j < colNames.size(); ++j)
             {
-                calcRowHelp(table, indexes, col, VecGreater(column->second, temp));
+                const ColumnStats& st = stats[j];
+                out << colNames[j] << " " << st.distinct() << " ";
+                if (st.min())
+                    out << *st.min() << " " << *st.max() << " ";
+                out << "\n";
             }
-            else
-                removeRow(table, VecGreater(column->second, temp));
-            break;
         }
+        out << "Analyzed " << values.size() << " rows in " << name << "\n";
+        //Installed like an index, once no reader is using the old stats
+        table->pendingStats = move(stats);
+        table->pendingCounted = snap.count;
+        table->uncounted = 0;
+        maintain(table);
     }
 
-
+    //EXPLAIN [ANALYZE] PRINT|DELETE|JOIN ...
+    void explain()
+    {
+        Plan current, *outer = plan;
+        current.phases = true;
+        string cmd;
+        in >> cmd;
+        if (cmd == "ANALYZE")
+        {
+            current.execute = true;
+            in >> cmd;
+        }
+
+        plan = &current;
+        switch (cmd[0])
+        {
+        case 'P':
+            print();
+            break;
+
+        case 'D':
+            deleteRows();
+            break;
+
+        case 'J':
+            join();
+            break;
+
+        default:
+            out << "Error: unrecognized command\n";
+            getline(in, cmd);
+        }
+        plan = outer;
+        if (outer)
+        {
+            outer->access = current.access;
+            outer->index = current.index;
+        }
+        //Nothing to report if the command failed before picking a plan
+        if (current.access.empty())
+            return;
+
+        auto end = chrono::steady_clock::now();
+        out << "Plan: " << current.access;
+        if (!current.index.empty())
+            out << " using " << current.index;
+        out << "\n";
+        if (current.buildRows != 0)
+        {
+            out << "Build: " << current.buildRows << " rows";
+            if (current.execute)
+                out << ", " << current.buildKeys << " keys";
+            out << "\n";
+        }
+        if (!current.execute)
+            return;
+
+        double parse = chrono::duration<double, milli>(current.execStart - current.start).count();
+        double total = chrono::duration<double, milli>(end - current.start).count();
+        double scan = max(0.0, total - parse - current.build - current.output);
+        out << "Rows: " << current.examined << " examined, " << current.emitted << " emitted\n";
+        ios_base::fmtflags flags = out.flags();
+        streamsize precision = out.precision();
+        out << fixed << setprecision(3) << "Time: parse " << parse << " ms, build " << current.build
+             << " ms, scan " << scan << " ms, output " << current.output << " ms, total " << total << " ms\n";
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    //Pins what a reading command sees of table: the rows committed so far,
+    //and the index and stats unless a writer has them. Doesn't wait on writers.
+    void pin(Table* table)
+    {
+        for (size_t i = 0; i < pins.size(); ++i)
+            if (pins[i].table == table)
+                return;
+        {
+            //Catches up on work writers left behind while readers had the table
+            unique_lock<mutex> writing(table->writer, try_to_lock);
+            if (writing)
+            {
+                awaitIndex(table);
+                maintain(table);
+            }
+        }
+        Pin p;
+        p.table = table;
+        p.reading = shared_lock<shared_mutex>(table->lock);
+        p.snap = latest(table);
+        p.indexing = shared_lock<shared_mutex>(table->indexLock, try_to_lock);
+        p.index = p.indexing.owns_lock() && table->indexed >= p.snap.count;
+        p.settled = p.index && table->dead == 0 && table->indexed == p.snap.count;
+        pins.push_back(move(p));
+    }
+
+    //Everything committed so far
+    static Snapshot latest(Table* table)
+    {
+        Snapshot snap{ &table->entries, table->committed, table->entries.size(), false };
+        //Read after committed: a delete adds to dead before it commits
+        snap.clean = table->dead == 0;
+        //Rows of a commit still in progress
+        while (snap.count > 0 && table->entries.born(snap.count - 1) > snap.version)
+            --snap.count;
+        return snap;
+    }
+
+    //The pinned snapshot for readers, the latest for writers
+    Snapshot snapshot(Table* table)
+    {
+        for (size_t i = 0; i < pins.size(); ++i)
+            if (pins[i].table == table)
+                return pins[i].snap;
+        return latest(table);
+    }
+
+    //Whether this command may use table's index and stats. Writers hold the
+    //writer lock, which is all that changes them.
+    bool indexOk(Table* table)
+    {
+        for (size_t i = 0; i < pins.size(); ++i)
+            if (pins[i].table == table)
+                return pins[i].index;
+        return true;
+    }
+
+    bool settled(Table* table)
+    {
+        for (size_t i = 0; i < pins.size(); ++i)
+            if (pins[i].table == table)
+                return pins[i].settled;
+        return table->dead == 0;
+    }
+
+    //Reclaims dead rows and brings the index and stats up to date, as far as
+    //readers allow without waiting for them. Needs the writer lock. Returns
+    //true if dead rows were reclaimed.
+    bool maintain(Table* table)
+    {
+        unique_lock<shared_mutex> indexing(table->indexLock, try_to_lock);
+        if (!indexing)
+            return false;
+        if (!table->pendingStats.empty())
+        {
+            table->stats = move(table->pendingStats);
+            table->pendingStats.clear();
+            table->counted = table->pendingCounted;
+        }
+        for (size_t j = 0; j < table->stats.size(); ++j)
+            table->stats[j].removed(table->uncounted);
+        table->uncounted = 0;
+        if (!table->stats.empty())
+            for (size_t i = table->counted; i < table->entries.size(); ++i)
+                for (size_t j = 0; j < table->stats.size(); ++j)
+                    table->stats[j].add(table->entries[i][j]);
+        table->counted = table->entries.size();
+
+        //Rows added since a finished build began are appended below
+        if (table->building && table->building->ready())
+            install(table);
+        table->abandoned.erase(remove_if(table->abandoned.begin(), table->abandoned.end(),
+            [](const unique_ptr<IndexBuild>& build) { return build->ready(); }), table->abandoned.end());
+
+        bool reclaimed = false;
+        //Rows can't move while a build is reading them
+        if (table->dead > 0 && !table->building && table->abandoned.empty())
+        {
+            unique_lock<shared_mutex> reading(table->lock, try_to_lock);
+            if (reading)
+            {
+                table->entries.compact();
+                table->dead = 0;
+                table->counted = table->entries.size();
+                reclaimed = true;
+            }
+        }
+
+        if (reclaimed)
+        {
+            //Row numbers moved, so the postings are rebuilt
+            if (!table->hash.empty())
+                Hash(table, table->index);
+            else if (!table->bst.empty())
+                BST(table, table->index);
+        }
+        else if (table->indexed < table->entries.size() && (!table->hash.empty() || !table->bst.empty()))
+        {
+            RowKey key(table, table->index);
+            for (size_t i = table->indexed; i < table->entries.size(); ++i)
+            {
+                const TableEntry& k = key(table->entries[i]);
+                if (!table->hash.empty())
+                {
+                    table->hash[k].push_back(i);
+                    table->bloom.add(BloomFilter::mix(hash<TableEntry>{}(k)));
+                }
+                else
+                    table->bst[k].push_back(i);
+            }
+            if (!table->hash.empty() && !table->bloom.fits(table->hash.size()))
+                table->bloom = bloomOf(table->hash);
+            table->rank.invalidate();
+        }
+        table->indexed = table->entries.size();
+        return reclaimed;
+    }
+
+    //Records the chosen access path for EXPLAIN. Returns true for a plain
+    //EXPLAIN, which stops the command here without running it.
+    bool choose(const string& access, const string& index = "")
+    {
+        if (!plan)
+            return false;
+        plan->access = access;
+        plan->index = index;
+        plan->execStart = chrono::steady_clock::now();
+        if (trace)
+            trace->complete("tokenize", "parse", plan->start, plan->execStart);
+        return !plan->execute;
+    }
+
+    bool dryRun() const
+    {
+        return plan && !plan->execute;
+    }
+
+    //Rows the chosen path looked at and rows it printed
+    void done(size_t examined, size_t emitted)
+    {
+        if (plan)
+        {
+            plan->examined = examined;
+            plan->emitted = emitted;
+            if (trace)
+                trace->complete(plan->access, plan->access.find("join") == string::npos ? "scan" : "probe", plan->execStart, chrono::steady_clock::now());
+        }
+    }
+
+    //Size of the hash table (or index) a command built
+    void built(size_t rows, size_t keys)
+    {
+        if (plan)
+        {
+            plan->buildRows = rows;
+            plan->buildKeys = keys;
+        }
+    }
+
+    double* buildTime()
+    {
+        return plan && plan->phases ? &plan->build : nullptr;
+    }
+
+    double* outputTime()
+    {
+        return plan && plan->phases ? &plan->output : nullptr;
+    }
+
+    string indexName(Table* table)
+    {
+        if (!indexOk(table))
+            return "";
+        if (!table->hash.empty())
+            return "hash index on " + table->name + "." + table->index;
+        if (!table->bst.empty())
+            return "bst index on " + table->name + "." + table->index;
+        return "";
+    }
+
+    //The table named on the rest of the line, or every table in name order.
+    //Returns false after reporting a name that isn't a table.
+    bool reportTables(vector<string>& names)
+    {
+        string rest, name;
+        getline(in, rest);
+        istringstream line(rest);
+        if (line >> name)
+        {
+            if (tables.find(name) == tables.end())
+            {
+                out << "Error: " << name << " does not name a table in the database\n";
+                return false;
+            }
+            names.push_back(name);
+        }
+        else
+        {
+            for (auto it = tables.begin(); it != tables.end(); ++it)
+                names.push_back(it->first);
+            sort(names.begin(), names.end());
+        }
+        return true;
+    }
+
+    //STATUS [<tablename>]
+    void status()
+    {
+        vector<string> names;
+        if (!reportTables(names))
+            return;
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            Table* table = &tables[names[i]];
+            //Only writers change the index; with no writer busy this installs
+            //a finished build if no reader is in the way. A writer may be
+            //waiting for the build itself, so STATUS never waits for one.
+            unique_lock<mutex> writing(table->writer, try_to_lock);
+            out << "Table " << table->name << ": ";
+            if (!writing)
+                out << "index busy, a command is writing to the table\n";
+            else
+            {
+                maintain(table);
+                if (!table->hash.empty())
+                    out << "hash index on " << table->index << "\n";
+                else if (!table->bst.empty())
+                    out << "bst index on " << table->index << "\n";
+                else
+                    out << "no index\n";
+            }
+            lock_guard<mutex> swapping(table->buildLock);
+            const IndexBuild* build = table->building.get();
+            if (!build)
+                continue;
+            out << "Table " << table->name << ": ";
+            if (build->ready())
+            {
+                out << "built " << build->type << " index on " << build->col << ", waiting for readers to let go of the index\n";
+                continue;
+            }
+            size_t done = min(build->progress.load(memory_order_relaxed), build->rows);
+            out << "building " << build->type << " index on " << build->col << ", " << done << " of " << build->rows
+                 << " rows (" << (build->rows == 0 ? 100 : done * 100 / build->rows) << "%)\n";
+        }
+        out << "Reported on " << names.size() << " tables\n";
+    }
+
+    //STATS [<tablename>]
+    void stats()
+    {
+        vector<string> names;
+        if (!reportTables(names))
+            return;
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            tableStats(&tables[names[i]]);
+            //One table pinned at a time
+            pins.clear();
+        }
+        out << "Reported on " << names.size() << " tables\n";
+    }
+
+    void tableStats(Table* table)
+    {
+        pin(table);
+        Snapshot snap = snapshot(table);
+        //Each row also carries the versions that added and deleted it
+        size_t entryBytes = table->entries.capacity() * (sizeof(vector<TableEntry>) + 2 * sizeof(uint64_t)), rows = 0;
+        for (size_t i = 0; i < table->entries.size(); ++i)
+        {
+            rows += snap.visible(i);
+            entryBytes += table->entries[i].capacity() * sizeof(TableEntry);
+            for (size_t j = 0; j < table->entries[i].size(); ++j)
+                entryBytes += EntryCodec::bytes(table->entries[i][j]) - sizeof(TableEntry);
+        }
+        out << "Table " << table->name << ": " << rows << " rows, " << table->cols.size()
+             << " columns, " << entryBytes << " bytes in entries\n";
+        if (table->entries.size() > rows)
+            out << "Versions: " << table->entries.size() - rows << " rows deleted or not yet committed\n";
+        if (!indexOk(table))
+        {
+            out << "Index busy\n";
+            return;
+        }
+
+        //Histogram of posting list lengths in powers of two
+        vector<size_t> lengths;
+        RowKey key(table, table->index);
+        auto posting = [&](const vector<size_t>& rows) {
+            size_t bucket = 0;
+            while ((size_t(2) << bucket) <= rows.size())
+                ++bucket;
+            if (lengths.size() <= bucket)
+                lengths.resize(bucket + 1);
+            ++lengths[bucket];
+            return rows.capacity() * sizeof(size_t) + EntryCodec::bytes(key(table->entries[rows[0]]));
+        };
+
+        if (!table->hash.empty())
+        {
+            const auto& hash = table->hash;
+            //Each node holds a next pointer, the cached hash and the pair
+            size_t bytes = hash.bucket_count() * sizeof(void*) + hash.size() * (2 * sizeof(void*) + sizeof(vector<size_t>));
+            size_t chain = 0;
+            for (size_t b = 0; b < hash.bucket_count(); ++b)
+                chain = max(chain, hash.bucket_size(b));
+            for (auto it = hash.begin(); it != hash.end(); ++it)
+                bytes += posting(it->second);
+            ios_base::fmtflags flags = out.flags();
+            streamsize precision = out.precision();
+            out << indexName(table) << ": " << hash.size() << " keys, " << bytes << " bytes, " << hash.bucket_count()
+                 << " buckets, load factor " << fixed << setprecision(2) << hash.load_factor() << ", longest chain " << chain << "\n";
+            out.flags(flags);
+            out.precision(precision);
+        }
+        else if (!table->bst.empty())
+        {
+            //Each tree node holds three pointers and a color
+            size_t bytes = table->bst.size() * (4 * sizeof(void*) + sizeof(vector<size_t>));
+            for (auto it = table->bst.begin(); it != table->bst.end(); ++it)
+                bytes += posting(it->second);
+            out << indexName(table) << ": " << table->bst.size() << " keys, " << bytes << " bytes\n";
+        }
+        else
+            out << "No index\n";
+
+        if (!lengths.empty())
+        {
+            out << "Posting lengths:";
+            for (size_t b = 0; b < lengths.size(); ++b)
+            {
+                size_t low = size_t(1) << b, high = (size_t(2) << b) - 1;
+                out << " " << low;
+                if (high != low)
+                    out << "-" << high;
+                out << ":" << lengths[b];
+            }
+            out << "\n";
+        }
+    }
+
+    static double toMs(uint64_t ns)
+    {
+        return static_cast<double>(ns) / 1e6;
+    }
+
+    //One line per slow command: time, first line of its text, sizes of the tables it names and its plan
+    void logSlow(const string& text, uint64_t ns, const Plan& current)
+    {
+        size_t begin = text.find_first_not_of(" \t\r\n");
+        if (begin == string::npos)
+            return;
+        size_t end = text.find_first_of("\r\n", begin);
+        string line = text.substr(begin, end == string::npos ? string::npos : end - begin);
+
+        lock_guard<mutex> guard(db->logging);
+        ofstream& os = *slowLog;
+        ios_base::fmtflags flags = os.flags();
+        os << fixed << setprecision(3) << toMs(ns) << " ms: " << line;
+        os.flags(flags);
+        os << " |";
+        vector<string> names = commandTables(line);
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            auto it = tables.find(names[i]);
+            if (it == tables.end())
+                continue;
+            shared_lock<shared_mutex> lock(it->second.lock);
+            os << " " << names[i] << " " << it->second.entries.size() << " rows";
+        }
+        os << " | " << (current.access.empty() ? "-" : current.access);
+        if (!current.index.empty())
+            os << " using " << current.index;
+        os << endl;
+    }
+
+    //Names of the tables a command line refers to, by position in its grammar
+    static vector<string> commandTables(const string& line)
+    {
+        istringstream stream(line);
+        vector<string> words;
+        string word;
+        while (stream >> word)
+            words.push_back(word);
+        size_t at = 0;
+        if (!words.empty() && words[0] == "EXPLAIN")
+            at = words.size() > 1 && words[1] == "ANALYZE" ? 2 : 1;
+        vector<string> names;
+        auto add = [&](size_t i) {
+            if (i < words.size())
+                names.push_back(words[i]);
+        };
+        if (at >= words.size())
+            return names;
+        switch (words[at][0])
+        {
+        case 'J':
+            add(at + 1);
+            add(at + 3);
+            break;
+
+        case 'I':
+        case 'D':
+        case 'P':
+        case 'G':
+            add(at + 2);
+            break;
+
+        default:
+            add(at + 1);
+        }
+        return names;
+    }
+
+    //Per command latency percentiles, on stderr for --replay so stdout stays comparable
+    void printLatencies(ostream& os)
+    {
+        ios_base::fmtflags flags = os.flags();
+        streamsize precision = os.precision();
+        os << fixed << setprecision(3) << "command count p50_ms p95_ms p99_ms max_ms \n";
+        for (auto it = latencies.begin(); it != latencies.end(); ++it)
+        {
+            const LatencyHistogram& h = it->second;
+            os << it->first << " " << h.count() << " " << toMs(h.percentile(0.5)) << " " << toMs(h.percentile(0.95))
+               << " " << toMs(h.percentile(0.99)) << " " << toMs(h.max()) << " \n";
+        }
+        os.flags(flags);
+        os.precision(precision);
+    }
+
+    void quit()
+    {
+        if (replay)
+            printLatencies(cerr);
+        out << "Thanks for being silly!\n";
+    }
+
+    void calcRows(Table* table, const vector<size_t>& indexes, const vector<string>& colNames, const string& col, bool print)
+    {
+        char op;
+        in >> op;
+        TableEntry value = readValue(table->types[table->cols[col]]);
+        string rest, word, name;
+        getline(in, rest);
+        istringstream line(rest);
+        //Values parse as they would from in, bools as true/false
+        line.flags(in.flags());
+        //Further AND <colname> = <value> conditions, before any ORDER BY / LIMIT
+        vector<pair<size_t, TableEntry>> conds;
+        conds.emplace_back(table->cols[col], move(value));
+        streampos at = line.tellg();
+        while (line >> word && word == "AND")
+        {
+            char op2 = '\0';
+            line >> name >> op2;
+            auto it = table->cols.find(name);
+            if (it == table->cols.end())
+            {
+                out << "Error: " << name << " does not name a column in " << table->name << "\n";
+                return;
+            }
+            if (op != '=' || op2 != '=')
+            {
+                out << "Error: only = conditions can be combined with AND\n";
+                return;
+            }
+            conds.emplace_back(it->second, readValue(table->types[it->second], line));
+            at = line.tellg();
+        }
+        line.clear();
+        line.seekg(at);
+        Order order;
+        if (print)
+        {
+            if (readOrder(table, order, line))
+                return;
+            printHeader(colNames);
+        }
+        if (conds.size() == 1)
+        {
+            split3(table, indexes, conds[0].second, col, print, op, order);
+            return;
+        }
+        if (print)
+            printEqualAll(table, indexes, VecEqualAll(move(conds)), order);
+        else
+            removeRow(table, VecEqualAll(move(conds)));
+    }
+
+    //PRINT ... WHERE with several = conditions. An index whose columns all
+    //have a condition is looked up with their values and the other
+    //conditions checked on the rows it finds; otherwise the table is scanned.
+    void printEqualAll(Table* table, const vector<size_t>& indexes, const VecEqualAll& predicate, const Order& order)
+    {
+        if (order.active())
+        {
+            printOrdered(table, indexes, predicate, order);
+            return;
+        }
+        Snapshot snap = snapshot(table);
+        bool covered = indexOk(table) && (!table->hash.empty() || !table->bst.empty());
+        string key, name;
+        const TableEntry* single = nullptr;
+        istringstream names(table->index);
+        size_t keyCols = 0;
+        while (covered && names >> name)
+        {
+            single = predicate.value(table->cols[name]);
+            covered = single != nullptr;
+            if (covered)
+                EntryCodec::pack(key, *single);
+            ++keyCols;
+        }
+        if (covered)
+        {
+            if (choose(table->hash.empty() ? "bst lookup" : "hash lookup", indexName(table)))
+                return;
+            //A single-column index is keyed on the value itself
+            TableEntry probe = keyCols == 1 ? TableEntry(*single) : TableEntry(move(key));
+            const vector<size_t>* rows = nullptr;
+            if (!table->hash.empty())
+            {
+                auto it = table->hash.find(probe);
+                rows = it == table->hash.end() ? nullptr : &it->second;
+            }
+            else
+            {
+                auto it = table->bst.find(probe);
+                rows = it == table->bst.end() ? nullptr : &it->second;
+            }
+            size_t count = 0, examined = rows ? rows->size() : 0;
+            for (size_t i = 0; i < examined; ++i)
+            {
+                size_t row = (*rows)[i];
+                if (!snap.visible(row) || !predicate(table->entries[row]))
+                    continue;
+                ++count;
+                if (!quiet)
+                    printRow(table, indexes, row);
+            }
+            out << "Printed " << count << " matching rows from " << table->name << "\n";
+            done(examined, count);
+            return;
+        }
+        if (choose("full scan"))
+            return;
+        size_t count = 0;
+        snap.scan([&](size_t i, const vector<TableEntry>& row) {
+            if (predicate(row))
+            {
+                ++count;
+                if (!quiet)
+                    printRow(table, indexes, i);
+            }
+        });
+        out << "Printed " << count << " matching rows from " << table->name << "\n";
+        done(snap.count, count);
+    }
+
+    //Remove does not need a vector
+    void calcRows(Table* table, const string& col, bool print)
+    {
+        vector<size_t> temp(0);
+        vector<string> names(0);
+        calcRows(table, temp, names, col, print);
+    }
+
+    TableEntry readValue(EntryType type)
+    {
+        return readValue(type, in);
+    }
+
+    TableEntry readValue(EntryType type, istream& is)
+    {
+        string sVal;
+        double dVal;
+        int iVal;
+        bool bVal;
+        switch (type)
+        {
+        case EntryType::Bool:
+            is >> bVal;
+            return TableEntry(bVal);
+        case EntryType::Double:
+            is >> dVal;
+            return TableEntry(dVal);
+        case EntryType::Int:
+            is >> iVal;
+            return TableEntry(iVal);
+        case EntryType::String:
+            is >> sVal;
+            return TableEntry(move(sVal));
+        }
+        terminate();
+    }
+
+    //Splits for bool
+    void split3(Table* table, const vector<size_t>& indexes, const TableEntry& temp, const string& col, bool print, char op, const Order& order)
+    {
+        auto column = table->cols.find(col);
+
+        switch (op)
+        {
+        case '<':
+        {
+            if (print)
+            {
+                calcRowHelp(table, indexes, col, VecLess(column->second, temp), order);
+            }
+            else
+                removeRow(table, VecLess(column->second, temp));
+            break;
+        }
+
+        case '=':
+        {
+            if (print)
+            {
+                calcRowHelp(table, indexes, col, VecEqual(column->second, temp), order);
+            }
+            else
+                removeRow(table, VecEqual(column->second, temp));
+            break;
+        }
+
+        case '>':
+            if (print)
+            {
+                calcRowHelp(table, indexes, col, VecGreater(column->second, temp), order);
+            }
+            else
+                removeRow(table, VecGreater(column->second, temp));
+            break;
+        }
+    }
+
+
     template<typename Pred>
-    void calcRowHelp(Table* table, const vector<size_t>& indexes, const string& col, Pred predicate)
+    void calcRowHelp(Table* table, const vector<size_t>& indexes, const string& col, Pred predicate, const Order& order)
     {
-        if (!table->bst.empty() && table->index == col)
+        if (order.active())
         {
+            printOrdered(table, indexes, predicate, order);
+            return;
+        }
+        Snapshot snap = snapshot(table);
+        bool indexed = indexOk(table) && table->index == col;
+        if (indexed && !table->hash.empty() && Pred::op == '=' && !preferScan(table, col, predicate))
+        {
+            //Postings are in row order, so this prints what a scan would
+            if (choose("hash lookup", indexName(table)))
+                return;
+            auto it = table->hash.find(predicate.value());
+            size_t count = 0, examined = it == table->hash.end() ? 0 : it->second.size();
+            for (size_t i = 0; i < examined; ++i)
+            {
+                if (!snap.visible(it->second[i]))
+                    continue;
+                ++count;
+                if (!quiet)
+                    printRow(table, indexes, it->second[i]);
+            }
+            out << "Printed " << count << " matching rows from " << table->name << "\n";
+            done(examined, count);
+            return;
+        }
+        if (indexed && !table->bst.empty() && (quiet || !preferScan(table, col, predicate)))
+        {
+            //Prefix counts are only right when every indexed row is visible
+            if (quiet && settled(table))
+            {
+                if (choose("rank count", indexName(table)))
+                    return;
+                table->rank.refresh(table->bst);
+                size_t count = rankCount(table->rank, predicate);
+                out << "Printed " << count << " matching rows from " << table->name << "\n";
+                done(0, count);
+                return;
+            }
+            if (choose("bst range", indexName(table)))
+                return;
             size_t count = 0;
             for (auto it = table->bst.begin(); it != table->bst.end(); ++it)
             {
                 if (predicate(it->first))
                 {
-                    count += it->second.size();
-                    if (!quiet)
+                    for (size_t i = 0; i < it->second.size(); ++i)
                     {
-                        for (size_t i = 0; i < it->second.size(); ++i)
-                        {
-                            for (size_t j = 0; j < indexes.size(); ++j)
-                            {
-                                cout << table->entries[it->second[i]][indexes[j]] << " ";
-                            }
-                            cout << "\n";
-                        }
+                        if (!snap.visible(it->second[i]))
+                            continue;
+                        ++count;
+                        if (!quiet)
+                            printRow(table, indexes, it->second[i]);
                     }
                 }
             }
-            cout << "Printed " << count << " matching rows from " << table->name << "\n";
+            out << "Printed " << count << " matching rows from " << table->name << "\n";
+            done(table->bst.size(), count);
             return;
         }
-        if (quiet)
+        if (choose("full scan"))
+            return;
+        size_t count = 0;
+        snap.scan([&](size_t i, const vector<TableEntry>& row) {
+            if (predicate(row))
+            {
+                ++count;
+                if (!quiet)
+                    printRow(table, indexes, i);
+            }
+        });
+        out << "Printed " << count << " matching rows from " << table->name << "\n";
+        done(snap.count, count);
+    }
+
+    //Only with statistics: an index is not worth it when most rows match
+    template<typename Pred>
+    bool preferScan(Table* table, const string& col, const Pred& predicate)
+    {
+        if (!indexOk(table) || table->stats.empty())
+            return false;
+        return table->stats[table->cols[col]].selectivity(Pred::op, predicate.value()) > scanFraction;
+    }
+
+    //Matching row counts straight from the rank index
+    size_t rankCount(const RankIndex& rank, const VecLess& predicate)
+    {
+        return rank.below(predicate.value());
+    }
+    size_t rankCount(const RankIndex& rank, const VecEqual& predicate)
+    {
+        return rank.atMost(predicate.value()) - rank.below(predicate.value());
+    }
+    size_t rankCount(const RankIndex& rank, const VecGreater& predicate)
+    {
+        return rank.total() - rank.atMost(predicate.value());
+    }
+
+    void printRow(Table* table, const vector<size_t>& indexes, size_t row)
+    {
+        PhaseTimer timer(outputTime());
+        for (size_t j = 0; j < indexes.size(); ++j)
+        {
+            out << table->entries[row][indexes[j]] << " ";
+        }
+        out << "\n";
+    }
+
+    //PRINT with ORDER BY and/or LIMIT
+    template<typename Pred>
+    void printOrdered(Table* table, const vector<size_t>& indexes, Pred predicate, const Order& order)
+    {
+        size_t count = 0, examined = 0;
+        Snapshot snap = snapshot(table);
+        //Streams straight off a bst index on the sort column
+        auto indexCol = table->cols.find(table->index);
+        if (order.sorted && indexOk(table) && !table->bst.empty() && indexCol != table->cols.end() && indexCol->second == order.col)
+        {
+            if (choose("ordered bst scan", indexName(table)))
+                return;
+            auto emit = [&](const vector<size_t>& rows) {
+                for (size_t i = 0; i < rows.size() && count < order.limit; ++i)
+                {
+                    ++examined;
+                    if (snap.visible(rows[i]) && predicate(table->entries[rows[i]]))
+                    {
+                        ++count;
+                        if (!quiet)
+                            printRow(table, indexes, rows[i]);
+                    }
+                }
+            };
+            if (order.desc)
+                for (auto it = table->bst.rbegin(); it != table->bst.rend() && count < order.limit; ++it)
+                    emit(it->second);
+            else
+                for (auto it = table->bst.begin(); it != table->bst.end() && count < order.limit; ++it)
+                    emit(it->second);
+            out << "Printed " << count << " matching rows from " << table->name << "\n";
+            done(examined, count);
+            return;
+        }
+
+        if (order.sorted && !quiet && sortBytes(table, indexes, order) > memoryBudget)
         {
-            cout << "Printed " << count_if(table->entries.begin(), table->entries.end(), predicate) << " matching rows from " << table->name << "\n";
+            if (choose("external merge sort"))
+                return;
+            printExternal(table, indexes, predicate, order);
             return;
         }
-        size_t count = 0;
-        size_t idx = table->cols[col];
-        for (size_t i = 0; i < table->entries.size(); ++i)
+
+        //Without a sort column the first matches in row order are enough
+        bool stopEarly = !order.sorted || quiet;
+        RowLess less(&table->entries, order.col, order.desc);
+        vector<size_t> rows;
+        priority_queue<size_t, vector<size_t>, RowLess> top(less);
+        bool bounded = order.sorted && order.limit < snap.count;
+        if (choose(stopEarly ? "full scan with limit" : bounded ? "top-k heap" : "parallel sort"))
+            return;
+        for (size_t i = 0; i < snap.count; ++i)
         {
-            if (predicate(table->entries[i][idx]))
+            ++examined;
+            if (!snap.visible(i) || !predicate(table->entries[i]))
+                continue;
+            if (bounded && !quiet)
             {
-                ++count;
-                for (size_t j = 0; j < indexes.size(); ++j)
+                //Keeps the best <limit> rows, top() is the worst of them
+                if (top.size() < order.limit)
+                    top.push(i);
+                else if (order.limit != 0 && less(i, top.top()))
                 {
-                    cout << table->entries[i][indexes[j]] << " ";
+                    top.pop();
+                    top.push(i);
                 }
-                cout << "\n";
+                continue;
+            }
+            rows.push_back(i);
+            if (stopEarly && rows.size() == order.limit)
+                break;
+        }
+
+        if (bounded && !quiet)
+        {
+            rows.resize(top.size());
+            for (size_t i = rows.size(); i > 0; --i)
+            {
+                rows[i - 1] = top.top();
+                top.pop();
             }
         }
-        cout << "Printed " << count << " matching rows from " << table->name << "\n";
+        else if (order.sorted && !quiet)
+        {
+            PhaseTimer timer(buildTime());
+            TraceSpan span("sort", "build");
+            parallelSort(rows.begin(), rows.end(), less);
+        }
+
+        count = min(rows.size(), order.limit);
+        if (!quiet)
+            for (size_t i = 0; i < count; ++i)
+                printRow(table, indexes, rows[i]);
+        out << "Printed " << count << " matching rows from " << table->name << "\n";
+        done(examined, count);
     }
 
-    template<typename Pred>
-    void removeRow(Table* table, Pred predicate)
+    //Estimated size of the sort input, judged from the first row
+    size_t sortBytes(Table* table, const vector<size_t>& indexes, const Order& order)
     {
-        size_t initial = table->entries.size();
-        auto start = table->entries.begin();
-
-        auto end = remove_if(table->entries.begin(), table->entries.end(), predicate);
+        if (table->entries.empty())
+            return 0;
+        size_t rowBytes = sizeof(SortRow) + EntryCodec::bytes(table->entries[0][order.col]);
+        for (size_t j = 0; j < indexes.size(); ++j)
+            rowBytes += EntryCodec::bytes(table->entries[0][indexes[j]]);
+        return rowBytes * min(snapshot(table).count, order.limit);
+    }
 
-        table->entries.resize(end - start);
-        size_t size = initial - table->entries.size();
+    //ORDER BY through sorted runs in tmpDir, merged straight to the output
+    template<typename Pred>
+    void printExternal(Table* table, const vector<size_t>& indexes, Pred predicate, const Order& order)
+    {
+        vector<EntryType> types{ table->types[order.col] };
+        for (size_t j = 0; j < indexes.size(); ++j)
+            types.push_back(table->types[indexes[j]]);
+        ExternalSorter<SortRow, SortRowCodec, SortRowLess> sorter(SortRowCodec(types), SortRowLess(order.desc), memoryBudget, tmpDir);
+
+        Snapshot snap = snapshot(table);
+        snap.scan([&](size_t i, const vector<TableEntry>& row) {
+            if (!predicate(row))
+                return;
+            SortRow rec;
+            rec.row = i;
+            rec.fields.reserve(types.size());
+            rec.fields.push_back(row[order.col]);
+            for (size_t j = 0; j < indexes.size(); ++j)
+                rec.fields.push_back(row[indexes[j]]);
+            sorter.push(move(rec));
+        });
 
-        cout << "Deleted " << size << " rows from " << table->name << "\n";
-        if (!table->hash.empty())
+        size_t count = 0;
+        bool whole = sorter.drain([&](const SortRow& rec) {
+            if (count == order.limit)
+                return false;
+            ++count;
+            PhaseTimer timer(outputTime());
+            for (size_t j = 1; j < rec.fields.size(); ++j)
+                out << rec.fields[j] << " ";
+            out << "\n";
+            return true;
+        });
+        if (!whole)
         {
-            //No need to clear and re-generate if no rows are deleted
-            if (size != 0)
-            {
-                table->hash.clear();
-                Hash(table, table->index);
-            }
+            out << "Error: sorted rows could not be read back from " << tmpDir << "\n";
+            return;
         }
-        if (!table->bst.empty())
-        {
-            //No need to clear and re-generate if no rows are deleted
-            if (size != 0)
+        out << "Printed " << count << " matching rows from " << table->name << "\n";
+        done(snap.count, count);
+    }
+
+    template<typename Pred>
+    void removeRow(Table* table, Pred predicate)
+    {
+        string index = indexName(table);
+        if (choose("full scan", index.empty() ? index : index + " (rebuilt)"))
+            return;
+        //Matches are marked dead under the next version, so readers pinned
+        //on an older one still see them
+        Snapshot snap = snapshot(table);
+        uint64_t version = snap.version + 1;
+        size_t size = 0;
+        snap.scan([&](size_t i, const vector<TableEntry>& row) {
+            if (predicate(row))
             {
-                table->bst.clear();
-                BST(table, table->index);
+                table->entries.kill(i, version);
+                ++size;
             }
+        });
+        table->dead += size;
+        table->uncounted += size;
+        table->committed = version;
+
+        out << "Deleted " << size << " rows from " << table->name << "\n";
+        done(snap.count, size);
+        PhaseTimer timer(buildTime());
+        if (maintain(table))
+        {
+            if (!table->hash.empty())
+                built(table->entries.size(), table->hash.size());
+            else if (!table->bst.empty())
+                built(table->entries.size(), table->bst.size());
         }
-        assert(table->bst.empty() || table->hash.empty());
     }
 
     bool checkCol(Table* table1, Table* table2, vector<pair<string, string>> &cols, const string& printCol, size_t printNum)
@@ -685,8 +2660,8 @@ private:
             if (table1->cols.find(printCol) == table1->cols.end())
             {
                 string trash;
-                cout << "Error: " << printCol << " does not name a column in " << table1->name << "\n";
-                getline(cin, trash);
+                out << "Error: " << printCol << " does not name a column in " << table1->name << "\n";
+                getline(in, trash);
                 return true;
             }
             cols.push_back({ table1->name, printCol });
@@ -696,8 +2671,8 @@ private:
             if (table2->cols.find(printCol) == table2->cols.end())
             {
                 string trash;
-                cout << "Error: " << printCol << " does not name a column in " << table2->name << "\n";
-                getline(cin, trash);
+                out << "Error: " << printCol << " does not name a column in " << table2->name << "\n";
+                getline(in, trash);
                 return true;
             }
             cols.push_back({ table2->name, printCol });
@@ -706,113 +2681,789 @@ private:
     }
 
     //Pair = {table, printCol}
-    void joinAlgo(Table* table1, Table* table2, const vector<pair<string, string>>& columns, const string &col1, const string &col2)
+    void joinAlgo(Table* table1, Table* table2, const vector<pair<string, string>>& columns, const string &col1, const string &col2, char op)
     {
         //Prints colNames
-        if (!quiet)
+        if (!quiet && !dryRun())
         {
             for (size_t i = 0; i < columns.size(); ++i)
             {
-                cout << columns[i].second << " ";
+                out << columns[i].second << " ";
             }
-            cout << "\n";
+            out << "\n";
         }
 
+        if (op == '<' || op == '>')
+        {
+            rangeJoin(table1, table2, columns, col1, col2, op);
+            return;
+        }
+        if (quiet && joinCount(table1, table2, col1, col2))
+            return;
         //Checks to see if either or both tables have an index
-        if (table2->index == col2 && !table2->hash.empty())
+        if (indexOk(table2) && table2->index == col2 && !table2->hash.empty())
         {
-            joinBoth(table1, table2, table2->hash, columns, col1);
+            if (choose("hash join", indexName(table2)))
+                return;
+            joinBoth(table1, table2, table2->hash, table2->bloom, columns, col1);
             return;
         }
-        else if(table2->index != col2 || table2->hash.empty())
+        else if (indexOk(table1) && indexOk(table2) && table1->index == col1 && table2->index == col2
+                 && !table1->bst.empty() && !table2->bst.empty())
         {
-            unordered_map<TableEntry, vector<size_t>> temp;
-            tempHash(table2, col2, temp);
-            joinBoth(table1, table2, temp, columns, col1);
+            joinMerge(table1, table2, columns);
             return;
         }
-        
-        size_t idx1 = table1->cols[col1], idx2 = table2->cols[col2], count = 0;
-        for (size_t i = 0; i < table1->entries.size(); ++i)
+        else if (indexOk(table1) && table1->index == col1 && !table1->hash.empty())
+        {
+            if (choose("hash join probing " + table1->name, indexName(table1)))
+                return;
+            joinProbeLeft(table1, table2, table1->hash, table1->bloom, settled(table1), columns, col2);
+        }
+        else
+        {
+            shared_ptr<const JoinHash> temp = cachedHash(table2, col2);
+            //A cached table1 map beats building either side
+            if (!temp && (cachedHash(table1, col1) || buildLeft(table1, table2, col1, col2)))
+            {
+                joinBuildLeft(table1, table2, columns, col1, col2);
+                return;
+            }
+            if (!temp && hashBytes(table2, col2) > spillBudget())
+            {
+                graceJoin(table1, table2, columns, col1, col2);
+                return;
+            }
+            built(table2->entries.size(), temp ? temp->map.size() : 0);
+            if (choose((temp ? "hash join reusing cached " : "hash join building on ") + table2->name))
+                return;
+            if (!temp)
+            {
+                PhaseTimer timer(buildTime());
+                temp = cacheHash(table2, col2);
+            }
+            built(table2->entries.size(), temp->map.size());
+            joinBoth(table1, table2, temp->map, temp->bloom, columns, col1);
+        }
+    }
+
+    //Postings per key that are exactly the rows this command sees of a
+    //table: its settled hash or bst index, or a cached join hash table
+    struct KeyCounts
+    {
+        const unordered_map<TableEntry, vector<size_t>>* hash = nullptr;
+        const map<TableEntry, vector<size_t>>* bst = nullptr;
+        shared_ptr<const JoinHash> cached;
+
+        size_t keys() const
+        {
+            return bst ? bst->size() : hash->size();
+        }
+
+        template<typename F>
+        void visit(F f) const
+        {
+            if (bst)
+                f(*bst);
+            else
+                f(*hash);
+        }
+    };
+
+    bool keyCounts(Table* table, const string& col, KeyCounts& counts)
+    {
+        if (settled(table) && table->index == col && (!table->hash.empty() || !table->bst.empty()))
+        {
+            if (table->hash.empty())
+                counts.bst = &table->bst;
+            else
+                counts.hash = &table->hash;
+            return true;
+        }
+        counts.cached = cachedHash(table, col);
+        counts.hash = counts.cached ? &counts.cached->map : nullptr;
+        return counts.hash != nullptr;
+    }
+
+    //Sum over the keys of small of its rows times large's rows with that key
+    template<typename Small, typename Large>
+    static size_t sharedCount(const Small& small, const Large& large)
+    {
+        size_t count = 0;
+        for (const auto& kv : small)
+        {
+            auto it = large.find(kv.first);
+            if (it != large.end())
+                count += kv.second.size() * it->second.size();
+        }
+        return count;
+    }
+
+    template<typename Small>
+    static size_t sharedCount(const Small& small, const unordered_map<TableEntry, vector<size_t>>& large)
+    {
+        size_t count = 0;
+        GroupProbe<unordered_map<TableEntry, vector<size_t>>> probe(large);
+        auto matched = [&](size_t rows, const vector<size_t>* postings) {
+            if (postings)
+                count += rows * postings->size();
+        };
+        for (const auto& kv : small)
+            probe.push(kv.first, kv.second.size(), matched);
+        probe.flush(matched);
+        return count;
+    }
+
+    //A quiet JOIN only needs the number of matches, the sum over shared keys
+    //of the product of their row counts. Walks the side with fewer keys.
+    //Returns false when either side has no exact counts per key.
+    bool joinCount(Table* table1, Table* table2, const string& col1, const string& col2)
+    {
+        KeyCounts counts1, counts2;
+        if (!keyCounts(table1, col1, counts1) || !keyCounts(table2, col2, counts2))
+            return false;
+        if (choose("join count from key frequencies"))
+            return true;
+        const KeyCounts& small = counts1.keys() <= counts2.keys() ? counts1 : counts2;
+        const KeyCounts& large = &small == &counts1 ? counts2 : counts1;
+        size_t count = 0;
+        small.visit([&](const auto& a) {
+            large.visit([&](const auto& b) {
+                count = sharedCount(a, b);
+            });
+        });
+        out << "Printed " << count << " rows from joining " << table1->name << " to " << table2->name << "\n";
+        done(small.keys(), count);
+        return true;
+    }
+
+    //(key, row) of a table's visible rows, sorted by key and then row
+    using KeyedRows = vector<pair<const TableEntry*, size_t>>;
+
+    bool rangeIndex(Table* table, const string& col)
+    {
+        return indexOk(table) && table->index == col && !table->bst.empty();
+    }
+
+    //Read off the bst index on col when there is one, sorted otherwise
+    KeyedRows ordered(Table* table, const string& col)
+    {
+        PhaseTimer timer(buildTime());
+        KeyedRows rows;
+        Snapshot snap = snapshot(table);
+        if (rangeIndex(table, col))
+        {
+            for (auto it = table->bst.begin(); it != table->bst.end(); ++it)
+                for (size_t i = 0; i < it->second.size(); ++i)
+                    if (snap.visible(it->second[i]))
+                        rows.emplace_back(&it->first, it->second[i]);
+            return rows;
+        }
+        TraceSpan span("sort", "build");
+        size_t idx = table->cols[col];
+        snap.scan([&](size_t i, const vector<TableEntry>& row) {
+            rows.emplace_back(&row[idx], i);
+        });
+        parallelSort(rows.begin(), rows.end(), [](const pair<const TableEntry*, size_t>& a, const pair<const TableEntry*, size_t>& b) {
+            if (*a.first < *b.first)
+                return true;
+            return !(*b.first < *a.first) && a.second < b.second;
+        });
+        return rows;
+    }
+
+    //The part of rows with keys above x, or below it
+    static pair<size_t, size_t> keyRange(const KeyedRows& rows, const TableEntry& x, bool above)
+    {
+        auto less = [](const pair<const TableEntry*, size_t>& a, const pair<const TableEntry*, size_t>& b) { return *a.first < *b.first; };
+        pair<const TableEntry*, size_t> probe(&x, 0);
+        if (above)
+            return { static_cast<size_t>(upper_bound(rows.begin(), rows.end(), probe, less) - rows.begin()), rows.size() };
+        return { 0, static_cast<size_t>(lower_bound(rows.begin(), rows.end(), probe, less) - rows.begin()) };
+    }
+
+    //Pair = {table, printCol}
+    //JOIN ... WHERE <colname1> < or > <colname2>. One side is put in key
+    //order, from its bst index if it has one (table2's preferred) and by
+    //sorting table2 otherwise, and each row of the other side binary
+    //searches for its matching range. Output is table1-major with table2
+    //rows in row order, as for an equi-join.
+    void rangeJoin(Table* table1, Table* table2, const vector<pair<string, string>>& columns, const string& col1, const string& col2, char op)
+    {
+        //Probing with table2 rows keeps their order but buffers the matches
+        bool flip = !rangeIndex(table2, col2) && rangeIndex(table1, col1);
+        Table* sorted = flip ? table1 : table2;
+        const string& col = flip ? col1 : col2;
+        bool indexed = rangeIndex(sorted, col);
+        if (!indexed)
+            built(sorted->entries.size(), 0);
+        if (choose(indexed ? "range join" : "range join sorting " + sorted->name, indexed ? indexName(sorted) : ""))
+            return;
+        KeyedRows rows = ordered(sorted, col);
+        if (!indexed)
+            built(rows.size(), rows.size());
+
+        size_t count = 0;
+        Snapshot snap1 = snapshot(table1), snap2 = snapshot(table2);
+        if (flip)
         {
-            for (size_t j = 0; j < table2->entries.size(); ++j)
+            //table1 row i matches table2 row j when i's key is below j's for <
+            size_t idx = table2->cols[col2];
+            vector<vector<size_t>> matches(quiet ? 0 : snap1.count);
+            snap2.scan([&](size_t j, const vector<TableEntry>& row) {
+                pair<size_t, size_t> range = keyRange(rows, row[idx], op == '>');
+                count += range.second - range.first;
+                if (!quiet)
+                    for (size_t k = range.first; k < range.second; ++k)
+                        matches[rows[k].second].push_back(j);
+            });
+            for (size_t i = 0; i < matches.size(); ++i)
+                for (size_t k = 0; k < matches[i].size(); ++k)
+                    printJoinRow(table1, table2, columns, i, matches[i][k]);
+            out << "Printed " << count << " rows from joining " << table1->name << " to " << table2->name << "\n";
+            done(snap2.count, count);
+            return;
+        }
+        size_t idx = table1->cols[col1];
+        vector<size_t> partners;
+        snap1.scan([&](size_t i, const vector<TableEntry>& row) {
+            pair<size_t, size_t> range = keyRange(rows, row[idx], op == '<');
+            count += range.second - range.first;
+            if (quiet)
+                return;
+            partners.clear();
+            for (size_t k = range.first; k < range.second; ++k)
+                partners.push_back(rows[k].second);
+            sort(partners.begin(), partners.end());
+            for (size_t k = 0; k < partners.size(); ++k)
+                printJoinRow(table1, table2, columns, i, partners[k]);
+        });
+        out << "Printed " << count << " rows from joining " << table1->name << " to " << table2->name << "\n";
+        done(snap1.count, count);
+    }
+
+    //Pair = {table, printCol}
+    void joinBoth(Table* table1, Table* table2, const unordered_map<TableEntry, vector<size_t>>& map, const BloomFilter& bloom, const vector<pair<string, string>>& columns, const string &col1)
+    {
+        size_t count = 0;
+        RowKey key1(table1, col1);
+        Snapshot snap1 = snapshot(table1), snap2 = snapshot(table2);
+        BloomProbe filter(bloom, useBloom(map, bloom));
+        GroupProbe<unordered_map<TableEntry, vector<size_t>>> probe(map);
+        auto matched = [&](size_t i, const vector<size_t>* postings) {
+            if (postings)
             {
-                if (table1->entries[i][idx1] == table2->entries[j][idx2])
+                for (size_t j = 0; j < postings->size(); ++j)
                 {
-                    count++;
+                    if (!snap2.visible((*postings)[j]))
+                        continue;
+                    ++count;
                     if (!quiet)
-                    {
-                        for (size_t k = 0; k < columns.size(); ++k)
-                        {
-                            if (columns[k].first == table1->name)
-                                cout << table1->entries[i][table1->cols[columns[k].second]] << " ";
-                            else
-                                cout << table2->entries[j][table2->cols[columns[k].second]] << " ";
-                        }
-                        cout << "\n";
-                    }
+                        printJoinRow(table1, table2, columns, i, (*postings)[j]);
                 }
             }
+        };
+        snap1.scan([&](size_t i, const vector<TableEntry>& row) {
+            const TableEntry& key = key1(row);
+            size_t h = hash<TableEntry>{}(key);
+            if (filter.active() && filter.reject(BloomFilter::mix(h)))
+                return;
+            probe.push(key, h, i, matched);
+        });
+        probe.flush(matched);
+        out << "Printed " << count << " rows from joining " << table1->name << " to " << table2->name << "\n";
+        done(snap1.count, count);
+    }
+
+    //Pair = {table, printCol}
+    void printJoinRow(Table* table1, Table* table2, const vector<pair<string, string>>& columns, size_t row1, size_t row2)
+    {
+        PhaseTimer timer(outputTime());
+        for (size_t k = 0; k < columns.size(); ++k)
+        {
+            if (columns[k].first == table1->name)
+                out << table1->entries[row1][table1->cols[columns[k].second]] << " ";
+            else
+                out << table2->entries[row2][table2->cols[columns[k].second]] << " ";
+        }
+        out << "\n";
+    }
+
+    //Memory a join hash table may take before it is partitioned; a budget
+    //below minSpillBytes would only make partitions too small to be worth a file
+    size_t spillBudget() const
+    {
+        return max(memoryBudget, minSpillBytes);
+    }
+
+    //Rough size of a hash index on col, each row costs its key plus a node and a posting
+    size_t hashBytes(Table* table, const string& col)
+    {
+        if (table->entries.empty())
+            return 0;
+        size_t perRow = EntryCodec::bytes(RowKey(table, col)(table->entries[0])) + 4 * sizeof(size_t);
+        return perRow * snapshot(table).count;
+    }
+
+    //Estimated hash table size from statistics: a node per distinct key plus a posting per row
+    size_t buildCost(Table* table, const string& col)
+    {
+        const ColumnStats& st = table->stats[table->cols[col]];
+        return st.distinct() * (EntryCodec::bytes(table->entries[0][table->cols[col]]) + 3 * sizeof(size_t)) + st.count() * sizeof(size_t);
+    }
+
+    //Hash table1 instead when that is cheaper: by distinct keys with
+    //statistics on both tables, by rows otherwise. Statistics are per
+    //column, so multi-column keys always go by rows.
+    bool buildLeft(Table* table1, Table* table2, const string& col1, const string& col2)
+    {
+        size_t left = hashBytes(table1, col1);
+        if (left > spillBudget() || table1->entries.empty() || table2->entries.empty())
+            return false;
+        if (!indexOk(table1) || !indexOk(table2) || table1->stats.empty() || table2->stats.empty()
+            || col1.find(' ') != string::npos)
+            return left < hashBytes(table2, col2);
+        return buildCost(table1, col1) < buildCost(table2, col2);
+    }
+
+    //Pair = {table, printCol}
+    //Walks the bst indexes on both join columns in key order together, so
+    //nothing is built. Each table1 row matches at most one table2 key, which
+    //is remembered per row so the output keeps its table1-major order.
+    void joinMerge(Table* table1, Table* table2, const vector<pair<string, string>>& columns)
+    {
+        if (choose("merge join", indexName(table1) + " and " + indexName(table2)))
+            return;
+        Snapshot snap1 = snapshot(table1), snap2 = snapshot(table2);
+        //Counts need no visibility checks when every posting is visible
+        bool exact1 = settled(table1), exact2 = settled(table2);
+        auto visible = [](const Snapshot& snap, bool exact, const vector<size_t>& rows) {
+            return exact ? rows.size() : static_cast<size_t>(count_if(rows.begin(), rows.end(),
+                [&snap](size_t i) { return snap.visible(i); }));
+        };
+        vector<const vector<size_t>*> partner(quiet ? 0 : snap1.count, nullptr);
+        size_t count = 0, steps = 0;
+        auto it1 = table1->bst.begin(), it2 = table2->bst.begin();
+        while (it1 != table1->bst.end() && it2 != table2->bst.end())
+        {
+            ++steps;
+            if (it1->first < it2->first)
+                ++it1;
+            else if (it2->first < it1->first)
+                ++it2;
+            else
+            {
+                count += visible(snap1, exact1, it1->second) * visible(snap2, exact2, it2->second);
+                if (!quiet)
+                    for (size_t i = 0; i < it1->second.size(); ++i)
+                        if (snap1.visible(it1->second[i]))
+                            partner[it1->second[i]] = &it2->second;
+                ++it1;
+                ++it2;
+            }
+        }
+        if (!quiet)
+            for (size_t i = 0; i < partner.size(); ++i)
+                if (partner[i])
+                    for (size_t j = 0; j < partner[i]->size(); ++j)
+                        if (snap2.visible((*partner[i])[j]))
+                            printJoinRow(table1, table2, columns, i, (*partner[i])[j]);
+        out << "Printed " << count << " rows from joining " << table1->name << " to " << table2->name << "\n";
+        done(steps, count);
+    }
+
+    //Pair = {table, printCol}
+    //Hashes table1 and probes with table2
+    void joinBuildLeft(Table* table1, Table* table2, const vector<pair<string, string>>& columns, const string &col1, const string &col2)
+    {
+        shared_ptr<const JoinHash> map = cachedHash(table1, col1);
+        built(table1->entries.size(), map ? map->map.size() : 0);
+        if (choose((map ? "hash join reusing cached " : "hash join building on ") + table1->name))
+            return;
+        if (!map)
+        {
+            PhaseTimer timer(buildTime());
+            map = cacheHash(table1, col1);
+        }
+        built(table1->entries.size(), map->map.size());
+        joinProbeLeft(table1, table2, map->map, map->bloom, true, columns, col2);
+    }
+
+    //Pair = {table, printCol}
+    //Probes map, keyed on table1's join column, with table2. Matches are
+    //buffered per table1 row so the output keeps its table1-major order.
+    //exact says every posting in map is visible.
+    void joinProbeLeft(Table* table1, Table* table2, const unordered_map<TableEntry, vector<size_t>>& map, const BloomFilter& bloom, bool exact, const vector<pair<string, string>>& columns, const string &col2)
+    {
+        Snapshot snap1 = snapshot(table1), snap2 = snapshot(table2);
+        vector<vector<size_t>> matches(quiet ? 0 : snap1.count);
+        size_t count = 0;
+        RowKey key2(table2, col2);
+        BloomProbe filter(bloom, useBloom(map, bloom));
+        GroupProbe<unordered_map<TableEntry, vector<size_t>>> probe(map);
+        auto matched = [&](size_t i, const vector<size_t>* postings) {
+            if (!postings)
+                return;
+            if (exact && quiet)
+            {
+                count += postings->size();
+                return;
+            }
+            for (size_t j = 0; j < postings->size(); ++j)
+            {
+                if (!exact && !snap1.visible((*postings)[j]))
+                    continue;
+                ++count;
+                if (!quiet)
+                    matches[(*postings)[j]].push_back(i);
+            }
+        };
+        snap2.scan([&](size_t i, const vector<TableEntry>& row) {
+            const TableEntry& key = key2(row);
+            size_t h = hash<TableEntry>{}(key);
+            if (filter.active() && filter.reject(BloomFilter::mix(h)))
+                return;
+            probe.push(key, h, i, matched);
+        });
+        probe.flush(matched);
+        if (!quiet)
+            for (size_t i = 0; i < matches.size(); ++i)
+                for (size_t j = 0; j < matches[i].size(); ++j)
+                    printJoinRow(table1, table2, columns, i, matches[i][j]);
+        out << "Printed " << count << " rows from joining " << table1->name << " to " << table2->name << "\n";
+        done(snap2.count, count);
+    }
+
+    //Writes (row, key) of every visible row to one of parts files picked by
+    //key hash, counting the records in each. Returns false if a file could
+    //not be opened or written.
+    bool partition(Table* table, const string& col, const vector<string>& files, vector<size_t>& counts)
+    {
+        counts.assign(files.size(), 0);
+        vector<ofstream> outs;
+        outs.reserve(files.size());
+        for (size_t p = 0; p < files.size(); ++p)
+        {
+            outs.emplace_back(files[p], ios::binary);
+            if (!outs.back())
+                return false;
         }
+        RowKey keyOf(table, col);
+        Snapshot snap = snapshot(table);
+        snap.scan([&](size_t i, const vector<TableEntry>& values) {
+            const TableEntry& key = keyOf(values);
+            size_t h = hash<TableEntry>{}(key);
+            //Remixed so partitions don't line up with the buckets used later
+            h = (h ^ (h >> 31)) * 0x9E3779B97F4A7C15ull;
+            size_t p = (h >> 32) % files.size();
+            uint64_t row = i;
+            outs[p].write(reinterpret_cast<const char*>(&row), sizeof(row));
+            EntryCodec::write(outs[p], key);
+            ++counts[p];
+        });
+        for (ofstream& os : outs)
+            if (!os.flush())
+                return false;
+        return true;
+    }
 
-        cout << "Printed " << count << " rows from joining " << table1->name << " to " << table2->name << "\n";
+    //Calls f(row, key) for the count records partition() wrote to file.
+    //Returns false if the file ends or fails before all of them are read.
+    template<typename F>
+    static bool readPartition(const string& file, EntryType type, size_t count, F f)
+    {
+        ifstream is(file, ios::binary);
+        uint64_t row;
+        for (size_t n = 0; n < count; ++n)
+        {
+            if (!is.read(reinterpret_cast<char*>(&row), sizeof(row)))
+                return false;
+            TableEntry key = EntryCodec::read(is, type);
+            if (!is)
+                return false;
+            f(static_cast<size_t>(row), key);
+        }
+        return true;
     }
 
     //Pair = {table, printCol}
-    void joinBoth(Table* table1, Table* table2, const unordered_map<TableEntry, vector<size_t>>& map, const vector<pair<string, string>>& columns, const string &col1)
+    //Grace hash join: both sides are split by key hash into partitions small
+    //enough to hash in memory, then the matches are sorted back into table1
+    //order. A partition is hashed whole, so one key with more rows than the
+    //budget holds still goes over it. Any spill I/O failure before output
+    //starts falls back to the in-memory join.
+    void graceJoin(Table* table1, Table* table2, const vector<pair<string, string>>& columns, const string &col1, const string &col2)
     {
-        size_t count = 0, colIdx = table1->cols[col1];
-        for (size_t i = 0; i < table1->entries.size(); ++i)
+        size_t parts = min<size_t>(256, hashBytes(table2, col2) / spillBudget() * 2 + 2);
+        built(table2->entries.size(), 0);
+        if (choose("grace hash join, " + to_string(parts) + " partitions"))
+            return;
+        vector<string> files1, files2;
+        auto cleanup = [&]() {
+            for (const string& file : files1)
+                std::remove(file.c_str());
+            for (const string& file : files2)
+                std::remove(file.c_str());
+        };
+        vector<size_t> counts1, counts2;
+        bool spilled;
         {
-            auto it = map.find(table1->entries[i][colIdx]);
-            if (it != map.end())
+            PhaseTimer timer(buildTime());
+            for (size_t p = 0; p < parts; ++p)
             {
+                files1.push_back(makeTempFile(tmpDir, "silly-join"));
+                files2.push_back(makeTempFile(tmpDir, "silly-join"));
+                if (files1.back().empty() || files2.back().empty())
+                    break;
+            }
+            TraceSpan span("partition", "io");
+            spilled = !files1.back().empty() && !files2.back().empty()
+                && partition(table1, col1, files1, counts1) && partition(table2, col2, files2, counts2);
+        }
+
+        EntryType type1 = RowKey(table1, col1).type(table1), type2 = RowKey(table2, col2).type(table2);
+        ExternalSorter<JoinPair, JoinPairCodec, less<JoinPair>> matches(JoinPairCodec(), less<JoinPair>(), memoryBudget, tmpDir);
+        size_t count = 0;
+        for (size_t p = 0; spilled && p < parts; ++p)
+        {
+            unordered_map<TableEntry, vector<size_t>> map;
+            spilled = readPartition(files2[p], type2, counts2[p], [&](size_t row, TableEntry& key) {
+                map[move(key)].push_back(row);
+            }) && readPartition(files1[p], type1, counts1[p], [&](size_t row, const TableEntry& key) {
+                auto it = map.find(key);
+                if (it == map.end())
+                    return;
                 count += it->second.size();
                 if (!quiet)
-                {
                     for (size_t j = 0; j < it->second.size(); ++j)
-                    {
-                        for (size_t k = 0; k < columns.size(); ++k)
-                        {
-                            if (columns[k].first == table1->name)
-                                cout << table1->entries[i][table1->cols[columns[k].second]] << " ";
-                            else
-                                cout << table2->entries[it->second[j]][table2->cols[columns[k].second]] << " ";
-                        }
-                        cout << "\n";
-                    }
-                }
-            }
+                        matches.push({ row, it->second[j] });
+            });
+        }
+        cleanup();
+        if (!spilled)
+        {
+            //Nowhere to spill to, or the disk failed us: join in memory after all
+            unordered_map<TableEntry, vector<size_t>> temp;
+            tempHash(table2, col2, temp);
+            joinBoth(table1, table2, temp, BloomFilter(), columns, col1);
+            return;
         }
-        cout << "Printed " << count << " rows from joining " << table1->name << " to " << table2->name << "\n";
+
+        if (!quiet && !matches.drain([&](const JoinPair& rec) {
+                printJoinRow(table1, table2, columns, rec.row1, rec.row2);
+                return true;
+            }))
+        {
+            out << "Error: join matches could not be read back from " << tmpDir << "\n";
+            return;
+        }
+        out << "Printed " << count << " rows from joining " << table1->name << " to " << table2->name << "\n";
+        done(table1->entries.size(), count);
+    }
+
+    //Keys of the first n rows on spec, read on all cores. Single-column keys
+    //point into the rows, packed ones into packed.
+    static vector<const TableEntry*> indexKeys(const Table* table, const string& spec, size_t n, vector<optional<TableEntry>>& packed)
+    {
+        vector<const TableEntry*> keys(n);
+        bool composite = spec.find(' ') != string::npos;
+        if (composite)
+            packed.resize(n);
+        parallelFor(n, [&](size_t begin, size_t end) {
+            RowKey key(table, spec);
+            table->entries.forEach(begin, end, [&](size_t i, const vector<TableEntry>& row) {
+                if (composite)
+                {
+                    packed[i].emplace(key(row));
+                    keys[i] = &*packed[i];
+                }
+                else
+                    keys[i] = &key(row);
+            });
+        });
+        return keys;
+    }
+
+    static bool bulkBuild(size_t n)
+    {
+        return n >= bulkRows && workerCount() > 1;
     }
 
     void Hash(Table* table, const string& col)
     {
+        TraceSpan span("Hash", "build");
         table->hash.clear();
         table->index = col;
-        size_t idx = table->cols[col];
-        for (size_t i = 0; i < table->entries.size(); ++i)
+        size_t n = table->entries.size();
+        fillHash(table, col, n, table->hash, nullptr);
+        table->bloom = bloomOf(table->hash);
+        table->indexed = n;
+    }
+
+    //Indexes the first n rows of table on col into index, counting the rows
+    //done in *progress if given
+    static void fillHash(const Table* table, const string& col, size_t n, unordered_map<TableEntry, vector<size_t>>& index, atomic<size_t>* progress)
+    {
+        if (bulkBuild(n))
+        {
+            bulkHash(table, col, n, index, progress);
+            return;
+        }
+        RowKey key(table, col);
+        table->entries.forEach(n, [&](size_t i, const vector<TableEntry>& row) {
+            index[key(row)].push_back(i);
+            if (progress)
+                progress->store(i + 1, memory_order_relaxed);
+        });
+    }
+
+    //Keys are hashed on all cores and the rows sorted by hash, so the table
+    //is sized for the distinct keys up front and each key goes in once with
+    //its whole posting list. std::hash<TableEntry> isn't cached in the
+    //nodes, so growing one row at a time hashes every key again.
+    static void bulkHash(const Table* table, const string& col, size_t n, unordered_map<TableEntry, vector<size_t>>& index, atomic<size_t>* progress)
+    {
+        vector<optional<TableEntry>> packed;
+        vector<const TableEntry*> keys = indexKeys(table, col, n, packed);
+        //(hash, row), rows of one key end up together and in row order
+        vector<pair<size_t, size_t>> order(n);
+        parallelFor(n, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                order[i] = { hash<TableEntry>{}(*keys[i]), i };
+        });
+        parallelSort(order.begin(), order.end(), less<pair<size_t, size_t>>());
+        size_t distinct = 0;
+        for (size_t i = 0; i < n; ++i)
+            distinct += i == 0 || order[i].first != order[i - 1].first;
+        index.reserve(distinct);
+
+        //Different keys with the same hash share a run, each is picked out in turn
+        const size_t taken = numeric_limits<size_t>::max();
+        for (size_t i = 0; i < n;)
         {
-            table->hash[table->entries[i][idx]].push_back(i);
+            size_t end = i;
+            while (end < n && order[end].first == order[i].first)
+                ++end;
+            for (size_t a = i; a < end; ++a)
+            {
+                if (order[a].second == taken)
+                    continue;
+                const TableEntry& key = *keys[order[a].second];
+                vector<size_t> postings;
+                for (size_t b = a; b < end; ++b)
+                {
+                    if (order[b].second != taken && *keys[order[b].second] == key)
+                    {
+                        postings.push_back(order[b].second);
+                        order[b].second = taken;
+                    }
+                }
+                index.emplace(key, move(postings));
+            }
+            i = end;
+            if (progress)
+                progress->store(end, memory_order_relaxed);
         }
     }
 
     void tempHash(Table* table, const string& col, unordered_map<TableEntry, vector<size_t>>& map)
     {
-        size_t idx = table->cols[col];
-        for (size_t i = 0; i < table->entries.size(); ++i)
-            map[table->entries[i][idx]].push_back(i);
+        TraceSpan span("tempHash", "build");
+        RowKey key(table, col);
+        Snapshot snap = snapshot(table);
+        snap.scan([&](size_t i, const vector<TableEntry>& row) {
+            map[key(row)].push_back(i);
+        });
+    }
+
+    //A cached join hash table over col built from this command's snapshot
+    shared_ptr<const JoinHash> cachedHash(Table* table, const string& col)
+    {
+        Snapshot snap = snapshot(table);
+        return db->joins.find(table->name, col, snap.version, snap.count);
+    }
+
+    //Builds a join hash table over col and caches it for later joins
+    shared_ptr<const JoinHash> cacheHash(Table* table, const string& col)
+    {
+        auto join = make_shared<JoinHash>();
+        tempHash(table, col, join->map);
+        if (join->map.size() >= bloomKeys)
+            join->bloom = bloomOf(join->map);
+        //Same estimate as buildCost: a node per key plus the postings
+        size_t bytes = join->bloom.bytes();
+        for (const auto& kv : join->map)
+            bytes += EntryCodec::bytes(kv.first) + 3 * sizeof(size_t) + kv.second.size() * sizeof(size_t);
+        Snapshot snap = snapshot(table);
+        db->joins.insert(table->name, col, snap.version, snap.count, join, bytes);
+        return join;
+    }
+
+    //A filter over map's keys with room for as many again
+    static BloomFilter bloomOf(const unordered_map<TableEntry, vector<size_t>>& map)
+    {
+        BloomFilter bloom(2 * map.size());
+        for (const auto& kv : map)
+            bloom.add(BloomFilter::mix(hash<TableEntry>{}(kv.first)));
+        return bloom;
+    }
+
+    //Smaller maps stay in cache, so a probe that misses costs less than the filter check
+    static bool useBloom(const unordered_map<TableEntry, vector<size_t>>& map, const BloomFilter& bloom)
+    {
+        return map.size() >= bloomKeys && bloom.fits(map.size());
     }
 
     void BST(Table* table, const string& col)
     {
+        TraceSpan span("BST", "build");
         table->bst.clear();
+        table->rank.invalidate();
         table->index = col;
-        size_t idx = table->cols[col];
-        for (size_t i = 0; i < table->entries.size(); ++i)
+        size_t n = table->entries.size();
+        fillBST(table, col, n, table->bst, nullptr);
+        table->indexed = n;
+    }
+
+    //fillHash for a bst index
+    static void fillBST(const Table* table, const string& col, size_t n, map<TableEntry, vector<size_t>>& index, atomic<size_t>* progress)
+    {
+        if (bulkBuild(n))
+        {
+            bulkBST(table, col, n, index, progress);
+            return;
+        }
+        RowKey key(table, col);
+        table->entries.forEach(n, [&](size_t i, const vector<TableEntry>& row) {
+            index[key(row)].push_back(i);
+            if (progress)
+                progress->store(i + 1, memory_order_relaxed);
+        });
+    }
+
+    //Rows sorted by key on all cores, then each key appended whole at the
+    //end of the tree, where the hint makes the insert constant time
+    static void bulkBST(const Table* table, const string& col, size_t n, map<TableEntry, vector<size_t>>& index, atomic<size_t>* progress)
+    {
+        vector<optional<TableEntry>> packed;
+        vector<const TableEntry*> keys = indexKeys(table, col, n, packed);
+        vector<size_t> order(n);
+        for (size_t i = 0; i < n; ++i)
+            order[i] = i;
+        parallelSort(order.begin(), order.end(), [&keys](size_t a, size_t b) {
+            if (*keys[a] < *keys[b])
+                return true;
+            return !(*keys[b] < *keys[a]) && a < b;
+        });
+        for (size_t i = 0; i < n;)
         {
-            table->bst[table->entries[i][idx]].push_back(i);
+            size_t end = i + 1;
+            while (end < n && *keys[order[end]] == *keys[order[i]])
+                ++end;
+            index.emplace_hint(index.end(), *keys[order[i]], vector<size_t>(order.begin() + static_cast<ptrdiff_t>(i), order.begin() + static_cast<ptrdiff_t>(end)));
+            i = end;
+            if (progress)
+                progress->store(end, memory_order_relaxed);
         }
     }
 };
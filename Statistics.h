@@ -0,0 +1,173 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Per-column statistics gathered by ANALYZE and used to pick access paths
+
+#pragma once
+
+#include "TableEntry.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+
+/* Statistics on one column:
+ *   - row count, kept current on INSERT and DELETE
+ *   - a HyperLogLog sketch for the number of distinct values, which INSERT
+ *     keeps feeding (DELETE can't take values out, so it only caps it)
+ *   - an equi-depth histogram: bounds[0] is the minimum, bounds.back() the
+ *     maximum and each of the buckets in between holds the same share of
+ *     rows as of the last ANALYZE. INSERT widens the ends when it needs to.
+ */
+class ColumnStats {
+public:
+    static constexpr size_t buckets = 16;
+
+    // Rebuilds everything from the column's values
+    void analyze(std::vector<const TableEntry*> values)
+    {
+        rows = values.size();
+        registers.assign(registerCount, 0);
+        bounds.clear();
+        for (const TableEntry* x : values)
+            sketch(*x);
+        if (values.empty())
+            return;
+
+        std::sort(values.begin(), values.end(), [](const TableEntry* a, const TableEntry* b) { return *a < *b; });
+        bounds.reserve(buckets + 1);
+        for (size_t i = 0; i < buckets; ++i)
+            bounds.push_back(*values[i * values.size() / buckets]);
+        bounds.push_back(*values.back());
+    }
+
+    // A row with value x was inserted
+    void add(const TableEntry& x)
+    {
+        ++rows;
+        sketch(x);
+        if (bounds.empty())
+        {
+            for (size_t i = 0; i <= buckets; ++i)
+                bounds.push_back(x);
+            return;
+        }
+        if (x < bounds.front())
+        {
+            //TableEntry can't be assigned to, so the bounds are copied over
+            std::vector<TableEntry> widened;
+            widened.reserve(bounds.size());
+            widened.push_back(x);
+            for (size_t i = 1; i < bounds.size(); ++i)
+                widened.push_back(bounds[i]);
+            bounds.swap(widened);
+        }
+        else if (x > bounds.back())
+        {
+            bounds.pop_back();
+            bounds.push_back(x);
+        }
+    }
+
+    // n rows were deleted
+    void removed(size_t n)
+    {
+        rows -= std::min(rows, n);
+    }
+
+    size_t count() const
+    {
+        return rows;
+    }
+
+    size_t distinct() const
+    {
+        if (rows == 0)
+            return 0;
+        double sum = 0;
+        size_t zeros = 0;
+        for (uint8_t r : registers)
+        {
+            sum += std::ldexp(1.0, -r);
+            zeros += r == 0;
+        }
+        double m = registerCount;
+        double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        //Linear counting is more accurate while many registers are empty
+        if (estimate < 2.5 * m && zeros != 0)
+            estimate = m * std::log(m / static_cast<double>(zeros));
+        return std::max<size_t>(1, std::min(rows, static_cast<size_t>(estimate + 0.5)));
+    }
+
+    // nullptr if the column has no rows
+    const TableEntry* min() const
+    {
+        return bounds.empty() ? nullptr : &bounds.front();
+    }
+    const TableEntry* max() const
+    {
+        return bounds.empty() ? nullptr : &bounds.back();
+    }
+
+    // Estimated fraction of rows whose value satisfies <op> x
+    double selectivity(char op, const TableEntry& x) const
+    {
+        if (bounds.empty())
+            return 0;
+        double less = lessFraction(x), equal = equalFraction(x);
+        switch (op)
+        {
+        case '<':
+            return less;
+        case '=':
+            return equal;
+        default:
+            return std::max(0.0, 1 - less - equal);
+        }
+    }
+
+private:
+    static constexpr size_t registerBits = 10, registerCount = size_t(1) << registerBits;
+
+    size_t rows = 0;
+    std::vector<uint8_t> registers = std::vector<uint8_t>(registerCount, 0);
+    std::vector<TableEntry> bounds;
+
+    void sketch(const TableEntry& x)
+    {
+        //splitmix64 finalizer, std::hash is the identity for ints
+        uint64_t h = std::hash<TableEntry>{}(x);
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebull;
+        h ^= h >> 31;
+        size_t reg = static_cast<size_t>(h >> (64 - registerBits));
+        uint64_t rest = h << registerBits;
+        uint8_t rank = static_cast<uint8_t>(rest == 0 ? 64 - registerBits + 1 : __builtin_clzll(rest) + 1);
+        registers[reg] = std::max(registers[reg], rank);
+    }
+
+    double lessFraction(const TableEntry& x) const
+    {
+        if (!(bounds.front() < x))
+            return 0;
+        if (bounds.back() < x)
+            return 1;
+        //x falls in the bucket ending at the first bound >= x, count half of it
+        size_t i = static_cast<size_t>(std::lower_bound(bounds.begin(), bounds.end(), x) - bounds.begin());
+        return (static_cast<double>(i) - 0.5) / buckets;
+    }
+
+    double equalFraction(const TableEntry& x) const
+    {
+        if (x < bounds.front() || x > bounds.back())
+            return 0;
+        //A value spanning several bounds is a heavy hitter
+        auto range = std::equal_range(bounds.begin(), bounds.end(), x);
+        double spanned = range.second - range.first > 1 ? static_cast<double>(range.second - range.first - 1) / buckets : 0;
+        return std::max(spanned, 1.0 / static_cast<double>(distinct()));
+    }
+};
@@ -91,6 +91,8 @@ class TableEntry {
 
   friend struct std::hash<TableEntry>;
   friend std::ostream& operator<<(std::ostream&, const TableEntry&);
+  // Binary encoding for spilling to disk, see EntryCodec.h
+  friend class EntryCodec;
 
   /*
     fast_pass taken from facebook's fatal library.
@@ -0,0 +1,144 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Chrome trace_event recording for --trace
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+/* Collects complete ("X") events from any thread and writes them as Chrome
+ * trace_event JSON when destroyed, which chrome://tracing and Perfetto both
+ * load. Only one trace records at a time, the one in active(); while that
+ * is nullptr a TraceSpan costs a load and a branch.
+ */
+class Trace {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit Trace(const std::string& p)
+        :path(p), origin(Clock::now())
+    {
+        //The thread that opens the trace is tid 1
+        threadId();
+    }
+    Trace(const Trace&) = delete;
+    Trace& operator=(const Trace&) = delete;
+    ~Trace()
+    {
+        write();
+    }
+
+    static Trace*& active()
+    {
+        static Trace* trace = nullptr;
+        return trace;
+    }
+
+    // Small id of the calling thread, in the order threads first ask
+    static uint32_t threadId()
+    {
+        static std::atomic<uint32_t> next(1);
+        thread_local uint32_t id = next++;
+        return id;
+    }
+
+    void complete(const std::string& name, const char* cat, Clock::time_point begin, Clock::time_point end)
+    {
+        Event e{ name, cat, micros(begin), micros(end) - micros(begin), threadId() };
+        std::lock_guard<std::mutex> lock(mtx);
+        events.push_back(std::move(e));
+    }
+
+private:
+    struct Event
+    {
+        std::string name;
+        const char* cat;
+        double ts, dur;
+        uint32_t tid;
+    };
+
+    std::string path;
+    Clock::time_point origin;
+    std::mutex mtx;
+    std::vector<Event> events;
+
+    double micros(Clock::time_point t) const
+    {
+        return std::chrono::duration<double, std::micro>(t - origin).count();
+    }
+
+    static std::string escape(const std::string& s)
+    {
+        std::string out;
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+                out += '\\';
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            }
+            else
+                out += c;
+        }
+        return out;
+    }
+
+    void write()
+    {
+        std::ofstream os(path);
+        uint32_t threads = 1;
+        for (const Event& e : events)
+            threads = std::max(threads, e.tid);
+        const char* sep = "\n";
+        os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for (uint32_t t = 1; t <= threads; ++t, sep = ",\n")
+            os << sep << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t << ",\"args\":{\"name\":\""
+               << (t == 1 ? std::string("main") : "worker " + std::to_string(t - 1)) << "\"}}";
+        os.setf(std::ios::fixed);
+        os.precision(3);
+        for (const Event& e : events)
+        {
+            os << sep << "{\"name\":\"" << escape(e.name) << "\",\"cat\":\"" << e.cat << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+               << e.tid << ",\"ts\":" << e.ts << ",\"dur\":" << e.dur << "}";
+            sep = ",\n";
+        }
+        os << "\n]}\n";
+    }
+};
+
+// Records the time until it goes out of scope as one event, if tracing
+class TraceSpan {
+public:
+    TraceSpan(const char* n, const char* c)
+        :trace(Trace::active()), name(n), cat(c)
+    {
+        if (trace)
+            begin = Trace::Clock::now();
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+    ~TraceSpan()
+    {
+        if (trace)
+            trace->complete(name, cat, begin, Trace::Clock::now());
+    }
+
+private:
+    Trace* trace;
+    const char* name;
+    const char* cat;
+    Trace::Clock::time_point begin;
+};
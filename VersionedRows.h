@@ -0,0 +1,224 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Append-only row store with per-row versions, for snapshot reads
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+
+/* Rows live in chunks that double in size and never move, so one writer can
+ * append while any number of readers look at rows already published. Each
+ * row carries the version that added it and the version that deleted it (0
+ * while live); a reader at version v sees the rows added at or before v and
+ * not deleted by then. Versions sit apart from the rows so a scan that needs
+ * no version checks only touches the rows. Deleted rows stay until compact(), which may only run
+ * with nobody else using the store.
+ */
+template <typename T>
+class VersionedRows {
+public:
+    VersionedRows()
+    {
+        for (size_t k = 0; k < maxChunks; ++k)
+        {
+            values[k].store(nullptr, std::memory_order_relaxed);
+            versions[k].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+    VersionedRows(const VersionedRows&) = delete;
+    VersionedRows& operator=(const VersionedRows&) = delete;
+    ~VersionedRows()
+    {
+        clear();
+    }
+
+    // Rows published so far, live or not
+    size_t size() const
+    {
+        return count.load(std::memory_order_acquire);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    // Rows there is room for without allocating
+    size_t capacity() const
+    {
+        size_t total = 0;
+        for (size_t k = 0; k < maxChunks && values[k].load(std::memory_order_acquire); ++k)
+            total += chunkSize(k);
+        return total;
+    }
+
+    T& operator[](size_t i)
+    {
+        return at(values, i);
+    }
+
+    const T& operator[](size_t i) const
+    {
+        return at(values, i);
+    }
+
+    uint64_t born(size_t i) const
+    {
+        return at(versions, i).born;
+    }
+
+    bool alive(size_t i, uint64_t version) const
+    {
+        const Version& v = at(versions, i);
+        if (v.born > version)
+            return false;
+        uint64_t died = v.died.load(std::memory_order_acquire);
+        return died == 0 || died > version;
+    }
+
+    void kill(size_t i, uint64_t version)
+    {
+        at(versions, i).died.store(version, std::memory_order_release);
+    }
+
+    // Calls f(i, row) for each of the first n rows, a chunk at a time
+    template <typename F>
+    void forEach(size_t n, F f) const
+    {
+        forEach(0, n, f);
+    }
+
+    // The same for rows begin to end - 1
+    template <typename F>
+    void forEach(size_t begin, size_t end, F f) const
+    {
+        if (begin >= end)
+            return;
+        size_t i = begin, k, off;
+        locate(begin, k, off);
+        for (; i < end; ++k)
+        {
+            const T* c = values[k].load(std::memory_order_acquire);
+            size_t first = firstRow(k), last = std::min(end, firstRow(k + 1));
+            for (; i < last; ++i)
+                f(i, c[i - first]);
+        }
+    }
+
+    // Makes room for n rows; writer only
+    void reserve(size_t n)
+    {
+        for (size_t k = 0; k < maxChunks && firstRow(k) < n; ++k)
+            chunk(k);
+    }
+
+    // Appends a row added by version; one writer at a time
+    void push_back(T&& value, uint64_t version)
+    {
+        size_t i = count.load(std::memory_order_relaxed), k, off;
+        locate(i, k, off);
+        chunk(k);
+        new (values[k].load(std::memory_order_relaxed) + off) T(std::move(value));
+        Version* v = versions[k].load(std::memory_order_relaxed) + off;
+        v->born = version;
+        new (&v->died) std::atomic<uint64_t>(0);
+        count.store(i + 1, std::memory_order_release);
+    }
+
+    // Drops every deleted row, keeping the rest in order. Returns how many
+    // went. Nobody else may be using the store.
+    size_t compact()
+    {
+        size_t n = size(), kept = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            Version& v = at(versions, i);
+            if (v.died.load(std::memory_order_relaxed) != 0)
+                continue;
+            if (kept != i)
+            {
+                at(values, kept) = std::move(at(values, i));
+                at(versions, kept).born = v.born;
+                at(versions, kept).died.store(0, std::memory_order_relaxed);
+            }
+            ++kept;
+        }
+        for (size_t i = kept; i < n; ++i)
+            destroy(i);
+        count.store(kept, std::memory_order_release);
+        return n - kept;
+    }
+
+    void clear()
+    {
+        size_t n = size();
+        for (size_t i = 0; i < n; ++i)
+            destroy(i);
+        count.store(0, std::memory_order_release);
+        for (size_t k = 0; k < maxChunks; ++k)
+        {
+            ::operator delete(values[k].exchange(nullptr));
+            ::operator delete(versions[k].exchange(nullptr));
+        }
+    }
+
+private:
+    struct Version
+    {
+        uint64_t born;
+        std::atomic<uint64_t> died;
+    };
+
+    //Chunk k holds base << k rows
+    static constexpr size_t base = 1024, maxChunks = 40;
+
+    std::atomic<T*> values[maxChunks];
+    std::atomic<Version*> versions[maxChunks];
+    std::atomic<size_t> count{ 0 };
+
+    static size_t chunkSize(size_t k)
+    {
+        return base << k;
+    }
+
+    static size_t firstRow(size_t k)
+    {
+        return base * ((size_t(1) << k) - 1);
+    }
+
+    static void locate(size_t i, size_t& k, size_t& off)
+    {
+        //Index of the highest set bit of i / base + 1
+        k = static_cast<size_t>(63 - __builtin_clzll(static_cast<unsigned long long>(i / base + 1)));
+        off = i - firstRow(k);
+    }
+
+    template <typename U>
+    static U& at(const std::atomic<U*>* array, size_t i)
+    {
+        size_t k, off;
+        locate(i, k, off);
+        return array[k].load(std::memory_order_acquire)[off];
+    }
+
+    //Allocates chunk k if it is not there yet
+    void chunk(size_t k)
+    {
+        if (values[k].load(std::memory_order_relaxed))
+            return;
+        versions[k].store(static_cast<Version*>(::operator new(sizeof(Version) * chunkSize(k))), std::memory_order_release);
+        values[k].store(static_cast<T*>(::operator new(sizeof(T) * chunkSize(k))), std::memory_order_release);
+    }
+
+    void destroy(size_t i)
+    {
+        at(values, i).~T();
+        at(versions, i).died.~atomic();
+    }
+};
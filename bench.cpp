@@ -0,0 +1,297 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Microbenchmarks for the SillyQL engine primitives, built with "make bench"
+//
+// $ ./silly_bench [--rows 10000,100000] [--reps 5] [--format csv|json] [--quiet]
+//
+// Engine benchmarks feed commands through readCommands() with cin swapped
+// for a string stream and cout thrown away, so they time parsing, the
+// operator and output formatting together, like a real command would.
+// Results go to stdout, one line per benchmark and table size.
+
+#include "SillyQL.cpp"
+
+#include <random>
+
+namespace {
+
+// Swallows everything written to it
+class NullBuf : public streambuf {
+public:
+    NullBuf()
+    {
+        setp(buf, buf + sizeof(buf));
+    }
+
+protected:
+    int overflow(int c) override
+    {
+        setp(buf, buf + sizeof(buf));
+        return c == EOF ? 0 : c;
+    }
+
+private:
+    char buf[1 << 12];
+};
+
+struct Result
+{
+    string name;
+    size_t rows, ops;
+    vector<double> ms;
+};
+
+class Bench {
+public:
+    Bench(size_t r, bool q)
+        :reps(r), quiet(q) {}
+
+    void run(size_t rows)
+    {
+        string fact = factTable(rows), dim = dimTable(rows / 10 + 1);
+
+        entries(rows);
+
+        timeCommands("insert", rows, rows, "", fact);
+        timeCommands("generate_hash", rows, rows, fact, "GENERATE FOR fact hash INDEX ON id\n" + awaitIndex("fact", "id"));
+        timeCommands("generate_bst", rows, rows, fact, "GENERATE FOR fact bst INDEX ON id\n" + awaitIndex("fact", "id"));
+        for (int pct : { 1, 10, 50, 100 })
+            timeCommands("scan_" + to_string(pct) + "pct", rows, rows, fact,
+                         "PRINT FROM fact 2 id s WHERE pct < " + to_string(pct) + "\n", false);
+        timeCommands("scan_bst_10pct", rows, rows, fact + "GENERATE FOR fact bst INDEX ON pct\n" + awaitIndex("fact", "pct"),
+                     "PRINT FROM fact 2 id s WHERE pct < 10\n", false);
+        timeCommands("delete_10pct", rows, rows, fact, "DELETE FROM fact WHERE pct < 10\n");
+        timeCommands("delete_10pct_hash", rows, rows, fact + "GENERATE FOR fact hash INDEX ON id\n" + awaitIndex("fact", "id"),
+                     "DELETE FROM fact WHERE pct < 10\n");
+        string join = "JOIN fact AND dim WHERE id = id2 AND PRINT 2 s 1 name 2\n";
+        timeCommands("join_temp_hash", rows, rows, fact + dim, join, false);
+        timeCommands("join_cached_hash", rows, rows, fact + dim + join, join, false, true);
+        timeCommands("join_hash_index", rows, rows, fact + dim + "GENERATE FOR dim hash INDEX ON id2\n" + awaitIndex("dim", "id2"),
+                     join, false);
+    }
+
+    void report(ostream& os, bool json) const
+    {
+        if (json)
+            os << "[\n";
+        else
+            os << "benchmark,rows,reps,median_ms,min_ms,ns_per_op\n";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const Result& r = results[i];
+            vector<double> ms = r.ms;
+            sort(ms.begin(), ms.end());
+            double median = ms[ms.size() / 2], nsPerOp = median * 1e6 / static_cast<double>(max<size_t>(r.ops, 1));
+            if (json)
+                os << "  {\"benchmark\": \"" << r.name << "\", \"rows\": " << r.rows << ", \"reps\": " << ms.size()
+                   << ", \"median_ms\": " << median << ", \"min_ms\": " << ms[0] << ", \"ns_per_op\": " << nsPerOp
+                   << (i + 1 == results.size() ? "}\n" : "},\n");
+            else
+                os << r.name << "," << r.rows << "," << ms.size() << "," << median << "," << ms[0] << "," << nsPerOp << "\n";
+        }
+        if (json)
+            os << "]\n";
+    }
+
+private:
+    size_t reps;
+    bool quiet;
+    vector<Result> results;
+    mt19937 rng{ 281 };
+
+    static double since(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    //fact(id, pct, d, s, flag): id is a foreign key into dim, pct is uniform in [0, 100)
+    string factTable(size_t rows)
+    {
+        ostringstream os;
+        os << "CREATE fact 5 int int double string bool id pct d s flag\n";
+        os << "INSERT INTO fact " << rows << " ROWS\n";
+        uniform_int_distribution<size_t> id(0, rows / 10);
+        uniform_int_distribution<int> pct(0, 99);
+        uniform_real_distribution<double> d(0, 1000);
+        for (size_t i = 0; i < rows; ++i)
+            os << id(rng) << " " << pct(rng) << " " << d(rng) << " s" << rng() % 100000 << " " << (rng() % 2 ? "true" : "false") << "\n";
+        return os.str();
+    }
+
+    //GENERATE only starts a build on another thread. Any PRINT on the table
+    //waits for it, and this one matches no rows, so it marks where the
+    //index is ready.
+    static string awaitIndex(const string& table, const string& col)
+    {
+        return "PRINT FROM " + table + " 1 " + col + " WHERE " + col + " = -1\n";
+    }
+
+    //dim(id2, name) with unique keys
+    string dimTable(size_t rows)
+    {
+        ostringstream os;
+        os << "CREATE dim 2 int string id2 name\n";
+        os << "INSERT INTO dim " << rows << " ROWS\n";
+        for (size_t i = 0; i < rows; ++i)
+            os << i << " name" << i << "\n";
+        return os.str();
+    }
+
+    //Runs setup and then times command, against a fresh database every rep
+    //unless fresh is false, in which case the same database is reused. JOINs
+    //build their hash table every time unless joinCache is true.
+    void timeCommands(const string& name, size_t rows, size_t ops, const string& setup, const string& command,
+                      bool fresh = true, bool joinCache = false)
+    {
+        Result r{ name, rows, ops, {} };
+        unique_ptr<SillyQL> db;
+        for (size_t i = 0; i < reps; ++i)
+        {
+            if (fresh || !db)
+            {
+                db = makeDb(joinCache);
+                feed(*db, setup);
+            }
+            auto start = chrono::steady_clock::now();
+            feed(*db, command);
+            r.ms.push_back(since(start));
+        }
+        results.push_back(r);
+    }
+
+    unique_ptr<SillyQL> makeDb(bool joinCache)
+    {
+        unique_ptr<SillyQL> db(new SillyQL);
+        char prog[] = "silly_bench", j[] = "--join-cache", zero[] = "0", q[] = "--quiet";
+        vector<char*> args{ prog };
+        if (!joinCache)
+        {
+            args.push_back(j);
+            args.push_back(zero);
+        }
+        if (quiet)
+            args.push_back(q);
+        optind = 1;
+        db->getOptions(static_cast<int>(args.size()), args.data());
+        return db;
+    }
+
+    static void feed(SillyQL& db, const string& script)
+    {
+        istringstream in(script + "QUIT\n");
+        streambuf* old = cin.rdbuf(in.rdbuf());
+        db.readCommands();
+        cin.rdbuf(old);
+    }
+
+    //TableEntry comparisons and std::hash<TableEntry>
+    void entries(size_t rows)
+    {
+        vector<TableEntry> ints, strings;
+        ints.reserve(rows);
+        strings.reserve(rows);
+        for (size_t i = 0; i < rows; ++i)
+        {
+            ints.emplace_back(static_cast<int>(rng() % 1000000));
+            strings.emplace_back("key" + to_string(rng() % 1000000));
+        }
+
+        auto compare = [&](const string& name, const vector<TableEntry>& v, bool equal) {
+            Result r{ name, rows, rows, {} };
+            for (size_t i = 0; i < reps; ++i)
+            {
+                size_t hits = 0;
+                auto start = chrono::steady_clock::now();
+                for (size_t j = 1; j < v.size(); ++j)
+                    hits += equal ? v[j] == v[j - 1] : v[j] < v[j - 1];
+                r.ms.push_back(since(start));
+                sink = sink + hits;
+            }
+            results.push_back(r);
+        };
+        auto hash = [&](const string& name, const vector<TableEntry>& v) {
+            Result r{ name, rows, rows, {} };
+            for (size_t i = 0; i < reps; ++i)
+            {
+                size_t h = 0;
+                auto start = chrono::steady_clock::now();
+                for (size_t j = 0; j < v.size(); ++j)
+                    h ^= std::hash<TableEntry>{}(v[j]);
+                r.ms.push_back(since(start));
+                sink = sink + h;
+            }
+            results.push_back(r);
+        };
+
+        compare("entry_less_int", ints, false);
+        compare("entry_equal_int", ints, true);
+        compare("entry_less_string", strings, false);
+        compare("entry_equal_string", strings, true);
+        hash("entry_hash_int", ints);
+        hash("entry_hash_string", strings);
+    }
+
+    //Results of the entry loops are stored here so the compiler can't drop them
+    volatile size_t sink = 0;
+};
+
+vector<size_t> parseSizes(const string& list)
+{
+    vector<size_t> sizes;
+    istringstream in(list);
+    string size;
+    while (getline(in, size, ','))
+        sizes.push_back(static_cast<size_t>(stoull(size)));
+    return sizes;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	ios_base::sync_with_stdio(false);
+	ostream out(cout.rdbuf());
+	NullBuf null;
+	cout.rdbuf(&null);
+	cin >> boolalpha;
+	cout << boolalpha;
+
+	vector<size_t> sizes{ 10000, 100000 };
+	size_t reps = 5;
+	bool json = false, quiet = false;
+	int option_index = 0, option = 0;
+	struct option longOpts[] = { {"rows", required_argument, nullptr, 'r'},
+	                             {"reps", required_argument, nullptr, 'n'},
+	                             {"format", required_argument, nullptr, 'f'},
+	                             {"quiet", no_argument, nullptr, 'q'},
+	                             {"help", no_argument, nullptr, 'h'},
+	                             { nullptr, 0, nullptr, '\0' } };
+	while ((option = getopt_long(argc, argv, "r:n:f:qh", longOpts, &option_index)) != -1) {
+		switch (option) {
+		case 'r':
+			sizes = parseSizes(optarg);
+			break;
+		case 'n':
+			reps = max<size_t>(1, static_cast<size_t>(stoull(optarg)));
+			break;
+		case 'f':
+			json = string(optarg) == "json";
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		case 'h':
+			out << "Command line options: -r <rows,...>, -n <reps>, -f csv|json, -q or -h\n";
+			return 0;
+		default:
+			return 1;
+		}
+	}
+
+	Bench bench(reps, quiet);
+	for (size_t rows : sizes)
+		bench.run(rows);
+	bench.report(out, json);
+	cout.rdbuf(out.rdbuf());
+	return 0;
+}
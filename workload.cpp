@@ -0,0 +1,250 @@
+// Project Identifier: C0F4DFE8B340D81183C208F70F9D2D797908754D
+
+// Synthetic SillyQL workload generator, built with "make workload"
+//
+// Writes a command script in the SillyQL input language to stdout: a CREATE
+// and bulk INSERT per table, a few indexes, then a stream of PRINT/JOIN reads
+// and INSERT/DELETE/GENERATE writes, ending in QUIT. Replay it with
+//
+// $ ./silly_workload --rows 100000 --commands 5000 --skew zipf > load.txt
+// $ ./silly --quiet --replay < load.txt > /dev/null
+//
+// Every table has an int column "key" drawn from [0, --keys) either
+// uniformly or with Zipf skew; predicates and joins are on that column.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+using namespace std;
+
+namespace {
+
+struct Config
+{
+    size_t tables = 2, rows = 10000, commands = 1000, cols = 4, keys = 1000, batch = 100;
+    vector<string> types{ "int", "string", "double", "bool" };
+    bool zipf = false;
+    double theta = 1.1, reads = 0.8;
+    unsigned seed = 281;
+};
+
+class Workload {
+public:
+    explicit Workload(const Config& c)
+        :config(c), rng(c.seed)
+    {
+        if (config.zipf)
+        {
+            //Cumulative weights of rank k ~ 1 / k^theta, sampled by binary search
+            cdf.reserve(config.keys);
+            double sum = 0;
+            for (size_t k = 1; k <= config.keys; ++k)
+            {
+                sum += 1 / pow(static_cast<double>(k), config.theta);
+                cdf.push_back(sum);
+            }
+            for (double& c : cdf)
+                c /= sum;
+        }
+    }
+
+    void write(ostream& os)
+    {
+        os << "# silly_workload: " << config.tables << " tables, " << config.rows << " rows, "
+           << config.commands << " commands, " << (config.zipf ? "zipf" : "uniform") << " keys\n";
+        for (size_t t = 0; t < config.tables; ++t)
+        {
+            os << "CREATE t" << t << " " << config.cols << " int";
+            for (size_t c = 1; c < config.cols; ++c)
+                os << " " << columnType(c);
+            os << " key";
+            for (size_t c = 1; c < config.cols; ++c)
+                os << " c" << c;
+            os << "\n";
+            insert(os, t, config.rows);
+            if (t % 2 == 0)
+                os << "GENERATE FOR t" << t << " " << (t % 4 == 0 ? "hash" : "bst") << " INDEX ON key\n";
+        }
+
+        uniform_real_distribution<double> unit(0, 1);
+        for (size_t i = 0; i < config.commands; ++i)
+        {
+            size_t t = pick(config.tables);
+            double roll = unit(rng);
+            if (roll < config.reads)
+                read(os, t, roll / config.reads);
+            else
+                writeCommand(os, t, (roll - config.reads) / (1 - config.reads));
+        }
+        os << "QUIT\n";
+    }
+
+private:
+    Config config;
+    mt19937_64 rng;
+    vector<double> cdf;
+
+    size_t pick(size_t n)
+    {
+        return uniform_int_distribution<size_t>(0, n - 1)(rng);
+    }
+
+    const string& columnType(size_t c) const
+    {
+        return config.types[(c - 1) % config.types.size()];
+    }
+
+    size_t key()
+    {
+        if (!config.zipf)
+            return pick(config.keys);
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        return static_cast<size_t>(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+    }
+
+    void value(ostream& os, const string& type)
+    {
+        switch (type[0])
+        {
+        case 'i':
+            os << pick(1000000);
+            break;
+        case 'd':
+            os << uniform_real_distribution<double>(0, 1000)(rng);
+            break;
+        case 'b':
+            os << (pick(2) ? "true" : "false");
+            break;
+        default:
+            os << "v" << pick(100000);
+        }
+    }
+
+    void insert(ostream& os, size_t t, size_t rows)
+    {
+        os << "INSERT INTO t" << t << " " << rows << " ROWS\n";
+        for (size_t r = 0; r < rows; ++r)
+        {
+            os << key();
+            for (size_t c = 1; c < config.cols; ++c)
+            {
+                os << " ";
+                value(os, columnType(c));
+            }
+            os << "\n";
+        }
+    }
+
+    //roll in [0, 1) picks the kind of read
+    void read(ostream& os, size_t t, double roll)
+    {
+        const char ops[] = { '=', '<', '>' };
+        if (roll < 0.6)
+            os << "PRINT FROM t" << t << " 2 key c1 WHERE key " << ops[pick(3)] << " " << key() << "\n";
+        else if (roll < 0.9 || config.tables < 2)
+            os << "PRINT FROM t" << t << " 1 c1 WHERE key = " << key() << "\n";
+        else
+        {
+            size_t other = (t + 1 + pick(config.tables - 1)) % config.tables;
+            os << "JOIN t" << t << " AND t" << other << " WHERE key = key AND PRINT 2 c1 1 c1 2\n";
+        }
+    }
+
+    void writeCommand(ostream& os, size_t t, double roll)
+    {
+        if (roll < 0.7)
+            insert(os, t, 1 + pick(config.batch));
+        else if (roll < 0.95)
+            os << "DELETE FROM t" << t << " WHERE key = " << key() << "\n";
+        else
+            os << "GENERATE FOR t" << t << " " << (pick(2) ? "hash" : "bst") << " INDEX ON key\n";
+    }
+};
+
+vector<string> split(const string& list)
+{
+    vector<string> parts;
+    istringstream in(list);
+    string part;
+    while (getline(in, part, ','))
+        parts.push_back(part);
+    return parts;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	ios_base::sync_with_stdio(false);
+	Config config;
+	int option_index = 0, option = 0;
+	struct option longOpts[] = { {"tables", required_argument, nullptr, 't'},
+	                             {"rows", required_argument, nullptr, 'r'},
+	                             {"commands", required_argument, nullptr, 'c'},
+	                             {"cols", required_argument, nullptr, 'n'},
+	                             {"types", required_argument, nullptr, 'y'},
+	                             {"keys", required_argument, nullptr, 'k'},
+	                             {"batch", required_argument, nullptr, 'b'},
+	                             {"skew", required_argument, nullptr, 's'},
+	                             {"zipf", required_argument, nullptr, 'z'},
+	                             {"reads", required_argument, nullptr, 'R'},
+	                             {"seed", required_argument, nullptr, 'S'},
+	                             {"help", no_argument, nullptr, 'h'},
+	                             { nullptr, 0, nullptr, '\0' } };
+	while ((option = getopt_long(argc, argv, "t:r:c:n:y:k:b:s:z:R:S:h", longOpts, &option_index)) != -1) {
+		switch (option) {
+		case 't':
+			config.tables = max<size_t>(1, stoull(optarg));
+			break;
+		case 'r':
+			config.rows = stoull(optarg);
+			break;
+		case 'c':
+			config.commands = stoull(optarg);
+			break;
+		case 'n':
+			config.cols = max<size_t>(2, stoull(optarg));
+			break;
+		case 'y':
+			config.types = split(optarg);
+			break;
+		case 'k':
+			config.keys = max<size_t>(1, stoull(optarg));
+			break;
+		case 'b':
+			config.batch = max<size_t>(1, stoull(optarg));
+			break;
+		case 's':
+			config.zipf = string(optarg) == "zipf";
+			break;
+		case 'z':
+			config.zipf = true;
+			config.theta = stod(optarg);
+			break;
+		case 'R':
+			config.reads = min(1.0, max(0.0, stod(optarg)));
+			break;
+		case 'S':
+			config.seed = static_cast<unsigned>(stoul(optarg));
+			break;
+		case 'h':
+			cout << "Command line options: --tables, --rows, --commands, --cols, --types int,string,...,\n"
+			     << "  --keys, --batch, --skew uniform|zipf, --zipf <theta>, --reads <fraction>, --seed\n";
+			return 0;
+		default:
+			return 1;
+		}
+	}
+	if (config.types.empty())
+		config.types.push_back("int");
+
+	Workload(config).write(cout);
+	return 0;
+}